@@ -39,6 +39,9 @@ leftstring C15 = "at"
 label A16 = "1 byte"
 rightstring B16 = "Un"
 leftstring C16 = "it"
+label A17 = "#Be byte"
+rightstring B17 = "Acc"
+leftstring C17 = "ents"
 label B19 = "Practice"
 label A20 = "1 byte"
 rightstring B20 = "BPM inc"
@@ -79,6 +82,8 @@ cellcolor A15 "fg=RED bg=BLACK underline=1"
 cellcolor B15:C15 "fg=BLACK bg=YELLOW"
 cellcolor A16 "fg=RED bg=BLACK underline=1"
 cellcolor B16:C16 "fg=BLACK bg=BLUE"
+cellcolor A17 "fg=RED bg=BLACK underline=1"
+cellcolor B17:C17 "fg=BLACK bg=GREEN"
 cellcolor A18:C18 "fg=WHITE bg=BLACK"
 cellcolor A19:C19 "fg=RED bg=BLACK bold=1 underline=1"
 cellcolor A20 "fg=RED bg=BLACK underline=1"
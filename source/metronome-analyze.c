@@ -0,0 +1,435 @@
+#include "metronome.h"
+#include "metronome-timeline.h"
+
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define READ_FRAMES     (16384)
+#define FFT_SIZE        (512)               // 11.6 ms window
+#define HOP             (256)               // 5.8 ms between flux values
+#define ENERGY_BLOCK    (32)                // 0.7 ms, the resolution onsets are refined to
+#define BINS            (FFT_SIZE/2)
+#define HALF            (FFT_SIZE/2)        // complex fft length for the real input
+
+#define PEAK_WINDOW     (32)                // flux values either side for the threshold
+#define PEAK_GAIN       (1.5f)
+#define MIN_GAP         (SAMPLE_RATE/20/HOP)
+#define MAX_MATCH_MS    (150.0)
+
+typedef float v4sf __attribute__((vector_size(16)));
+typedef int32_t v4si __attribute__((vector_size(16)));
+
+struct Onsets {
+    double *seconds;
+    size_t count;
+    size_t capacity;
+};
+
+// Streaming spectral flux. Each hop the last FFT_SIZE samples are
+// windowed, transformed as a half length complex fft, and compared bin by
+// bin with the previous frame's log magnitudes. The flux finds onsets,
+// a short time energy envelope kept alongside places them.
+struct Flux {
+    float window[FFT_SIZE];
+    float cos_table[HALF/2];
+    float sin_table[HALF/2];
+    float post_cos[HALF];
+    float post_sin[HALF];
+    uint16_t reverse[HALF];
+
+    float re[HALF];
+    float im[HALF];
+    v4sf previous[BINS/4];
+
+    float *values;
+    size_t count;
+    size_t capacity;
+
+    float *energy;
+    size_t energy_count;
+    size_t energy_capacity;
+    float block;
+    uint32_t block_samples;
+};
+
+static void flux_init(struct Flux *f) {
+    memset(f, 0, sizeof(*f));
+    for(int i=0; i<FFT_SIZE; ++i) {
+        f->window[i] = 0.5f - 0.5f * cosf(2.0f * M_PI * i / FFT_SIZE);
+    }
+    for(int i=0; i<HALF/2; ++i) {
+        f->cos_table[i] =  cosf(2.0f * M_PI * i / HALF);
+        f->sin_table[i] = -sinf(2.0f * M_PI * i / HALF);
+    }
+    for(int i=0; i<HALF; ++i) {
+        f->post_cos[i] =  cosf(2.0f * M_PI * i / FFT_SIZE);
+        f->post_sin[i] = -sinf(2.0f * M_PI * i / FFT_SIZE);
+
+        int reversed = 0;
+        for(int bit=1, r=HALF>>1; bit<HALF; bit<<=1, r>>=1) {
+            if(i & bit) { reversed |= r; }
+        }
+        f->reverse[i] = reversed;
+    }
+}
+
+// iterative radix 2 over split real and imaginary arrays
+static void fft(struct Flux *f) {
+    for(int i=0; i<HALF; ++i) {
+        const int j = f->reverse[i];
+        if(j > i) {
+            float t = f->re[i]; f->re[i] = f->re[j]; f->re[j] = t;
+            t = f->im[i]; f->im[i] = f->im[j]; f->im[j] = t;
+        }
+    }
+    for(int size=2; size<=HALF; size<<=1) {
+        const int half = size/2;
+        const int stride = HALF/size;
+        for(int start=0; start<HALF; start+=size) {
+            for(int k=0; k<half; ++k) {
+                const float wr = f->cos_table[k*stride];
+                const float wi = f->sin_table[k*stride];
+                const int a = start+k, b = a+half;
+                const float tr = f->re[b]*wr - f->im[b]*wi;
+                const float ti = f->re[b]*wi + f->im[b]*wr;
+                f->re[b] = f->re[a] - tr;
+                f->im[b] = f->im[a] - ti;
+                f->re[a] += tr;
+                f->im[a] += ti;
+            }
+        }
+    }
+}
+
+// Mitchell's approximation, the float's bits read as an integer are a
+// scaled, offset log2. Plenty for comparing spectra and branch free.
+static inline v4sf fast_log2(const v4sf x) {
+    const v4si bits = (v4si)x;
+    return __builtin_convertvector(bits, v4sf) * (1.0f / (1 << 23)) - 127.0f;
+}
+
+static void flux_frame(struct Flux *f, const float *samples) {
+    // even samples into re, odd into im, the real fft of FFT_SIZE points
+    for(int i=0; i<HALF; ++i) {
+        f->re[i] = samples[2*i]   * f->window[2*i];
+        f->im[i] = samples[2*i+1] * f->window[2*i+1];
+    }
+    fft(f);
+
+    // untangle the two interleaved spectra into bins 0 .. BINS-1
+    float power[BINS] __attribute__((aligned(16)));
+    for(int k=0; k<BINS; ++k) {
+        const int n = (HALF - k) & (HALF-1);
+        const float er = 0.5f * (f->re[k] + f->re[n]);
+        const float ei = 0.5f * (f->im[k] - f->im[n]);
+        const float or = 0.5f * (f->im[k] + f->im[n]);
+        const float oi = -0.5f * (f->re[k] - f->re[n]);
+        const float xr = er + or*f->post_cos[k] - oi*f->post_sin[k];
+        const float xi = ei + or*f->post_sin[k] + oi*f->post_cos[k];
+        power[k] = xr*xr + xi*xi;
+    }
+
+    // half wave rectified rise of the log magnitudes, four bins at a time
+    const v4sf silence = {1e-6f, 1e-6f, 1e-6f, 1e-6f};
+    const v4sf zero = {0.f, 0.f, 0.f, 0.f};
+    v4sf sum = zero;
+    for(int k=0; k<BINS/4; ++k) {
+        v4sf p;
+        memcpy(&p, &power[k*4], sizeof(p));
+        const v4sf magnitude = 0.5f * fast_log2(p + silence);
+        const v4sf rise = magnitude - f->previous[k];
+        sum += (v4sf)((v4si)rise & (rise > zero));
+        f->previous[k] = magnitude;
+    }
+
+    if(f->count == f->capacity) {
+        f->capacity = f->capacity ? f->capacity*2 : 65536;
+        f->values = realloc(f->values, f->capacity * sizeof(float));
+    }
+    f->values[f->count++] = sum[0] + sum[1] + sum[2] + sum[3];
+}
+
+static void add_energy(struct Flux *f, const float *samples, const size_t count) {
+    for(size_t i=0; i<count; ++i) {
+        f->block += samples[i] * samples[i];
+        if(++f->block_samples < ENERGY_BLOCK) { continue; }
+
+        if(f->energy_count == f->energy_capacity) {
+            f->energy_capacity = f->energy_capacity ? f->energy_capacity*2 : 65536;
+            f->energy = realloc(f->energy, f->energy_capacity * sizeof(float));
+        }
+        f->energy[f->energy_count++] = f->block;
+        f->block = 0.f;
+        f->block_samples = 0;
+    }
+}
+
+// Decodes the take in chunks, mono at the engine's rate, and keeps one
+// window of history between chunks. Half a window of silence up front
+// centres frame i on sample i*HOP.
+static int read_flux(const char *path, struct Flux *f, uint64_t *frames) {
+    ma_decoder decoder;
+    ma_decoder_config config = ma_decoder_config_init(ma_format_f32, 1, SAMPLE_RATE);
+    if(ma_decoder_init_file(path, &config, &decoder) != MA_SUCCESS) {
+        return -1;
+    }
+
+    static float buffer[FFT_SIZE + READ_FRAMES];
+    memset(buffer, 0, FFT_SIZE/2 * sizeof(float));
+    size_t filled = FFT_SIZE/2;
+    *frames = 0;
+    for(;;) {
+        ma_uint64 read = 0;
+        ma_decoder_read_pcm_frames(&decoder, &buffer[filled], READ_FRAMES, &read);
+        if(read == 0) { break; }
+        add_energy(f, &buffer[filled], read);
+        filled += read;
+        *frames += read;
+
+        size_t start = 0;
+        while(start + FFT_SIZE <= filled) {
+            flux_frame(f, &buffer[start]);
+            start += HOP;
+        }
+        memmove(buffer, &buffer[start], (filled - start) * sizeof(float));
+        filled -= start;
+    }
+    ma_decoder_uninit(&decoder);
+    return 0;
+}
+
+// The flux peaks wherever the onset falls inside the window, so the
+// onset itself is where the energy envelope around the peak first climbs
+// a quarter of the way from the quietest to the loudest block.
+static double refine_onset(const struct Flux *f, const double centre) {
+    const long n = f->energy_count;
+    long from = (long)(centre - FFT_SIZE) / ENERGY_BLOCK;
+    long to = (long)(centre + FFT_SIZE/2) / ENERGY_BLOCK;
+    if(from < 0) { from = 0; }
+    if(to > n-1) { to = n-1; }
+    if(to <= from) { return centre; }
+
+    long loudest = from;
+    for(long b=from; b<=to; ++b) {
+        if(f->energy[b] > f->energy[loudest]) { loudest = b; }
+    }
+    float quietest = f->energy[loudest];
+    for(long b=from; b<loudest; ++b) {
+        if(f->energy[b] < quietest) { quietest = f->energy[b]; }
+    }
+    const float threshold = quietest + 0.25f * (f->energy[loudest] - quietest);
+
+    long b = loudest;
+    while(b > from && f->energy[b-1] >= threshold) { b--; }
+    if(b == from) { return (double)b * ENERGY_BLOCK; }
+
+    // linear between the last block below and the first above
+    const float below = f->energy[b-1], above = f->energy[b];
+    const double fraction = (above > below) ? (threshold - below) / (above - below) : 0.0;
+    return (b - 1 + fraction) * ENERGY_BLOCK + ENERGY_BLOCK/2;
+}
+
+// Local maxima above a moving mean, at least MIN_GAP apart.
+static void pick_onsets(const struct Flux *f, struct Onsets *o) {
+    const size_t n = f->count;
+    double *prefix = malloc((n+1) * sizeof(double));
+    prefix[0] = 0.0;
+    for(size_t i=0; i<n; ++i) {
+        prefix[i+1] = prefix[i] + f->values[i];
+    }
+    const double minimum = 0.1 * prefix[n] / (n ? n : 1);
+
+    size_t last = 0;
+    for(size_t i=1; i+1<n; ++i) {
+        const float v = f->values[i];
+        if(v <= f->values[i-1] || v < f->values[i+1]) { continue; }
+
+        const size_t from = (i > PEAK_WINDOW) ? i - PEAK_WINDOW : 0;
+        const size_t to = (i + PEAK_WINDOW < n) ? i + PEAK_WINDOW : n;
+        const double mean = (prefix[to] - prefix[from]) / (to - from);
+        if(v < PEAK_GAIN * mean + minimum) { continue; }
+
+        if(o->count > 0 && i - last < MIN_GAP) {
+            // too close to the previous onset, keep the stronger of the two
+            if(v <= f->values[last]) { continue; }
+            o->count--;
+        }
+        if(o->count == o->capacity) {
+            o->capacity = o->capacity ? o->capacity*2 : 4096;
+            o->seconds = realloc(o->seconds, o->capacity * sizeof(double));
+        }
+        o->seconds[o->count++] = refine_onset(f, (double)i * HOP) / SAMPLE_RATE;
+        last = i;
+    }
+    free(prefix);
+}
+
+static void report(const struct Timeline *t, const struct Onsets *o, const double latency, const uint8_t verbose) {
+    double *deviation = malloc(t->count * sizeof(double));
+    double *at = malloc(t->count * sizeof(double));
+    size_t beats = 0;
+    size_t hits = 0;
+    size_t unclicked = 0;  // beats of dropped bars left unplayed
+    size_t next = 0;
+
+    for(size_t k=0; k<t->count; ++k) {
+        // nobody plays along with the count-in
+        if(t->beats[k].count_in) { continue; }
+
+        const double expected = (double)t->beats[k].frame / SAMPLE_RATE;
+        const double before = (k > 0) ? expected - (double)t->beats[k-1].frame / SAMPLE_RATE : INFINITY;
+        const double after = ((k+1 < t->count) ? (double)t->beats[k+1].frame : (double)t->end) / SAMPLE_RATE - expected;
+        const double window = fmin(MAX_MATCH_MS / 1000.0, 0.5 * fmin(before, after));
+
+        // onsets are sorted, so the search resumes where the last beat left it
+        while(next < o->count && o->seconds[next] - latency < expected - window) { next++; }
+        double best = INFINITY;
+        for(size_t i=next; i<o->count && o->seconds[i] - latency <= expected + window; ++i) {
+            const double d = o->seconds[i] - latency - expected;
+            if(fabs(d) < fabs(best)) { best = d; }
+        }
+
+        // a beat nobody heard is only scored when it was played
+        if(isinf(best) && t->beats[k].silent) {
+            unclicked++;
+        } else {
+            beats++;
+        }
+        if(verbose) {
+            if(isinf(best)) {
+                printf("  %3u.%-2u %9.3fs   %s\n", t->beats[k].measure+1, t->beats[k].beat+1, expected, t->beats[k].silent ? "unclicked" : "missed");
+            } else {
+                printf("  %3u.%-2u %9.3fs %+7.1f ms\n", t->beats[k].measure+1, t->beats[k].beat+1, expected, best * 1000.0);
+            }
+        }
+        if(!isinf(best)) {
+            deviation[hits] = best * 1000.0;
+            at[hits] = expected / 60.0;
+            hits++;
+        }
+    }
+
+    double mean = 0.0, mean_t = 0.0;
+    for(size_t i=0; i<hits; ++i) {
+        mean += deviation[i] / hits;
+        mean_t += at[i] / hits;
+    }
+    double num = 0.0, den = 0.0;
+    for(size_t i=0; i<hits; ++i) {
+        num += (at[i] - mean_t) * (deviation[i] - mean);
+        den += (at[i] - mean_t) * (at[i] - mean_t);
+    }
+    const double slope = (den > 0.0) ? num / den : 0.0;   // ms per minute
+
+    // spread around the trend line, a steady rush is a tendency, not instability
+    double spread = 0.0;
+    for(size_t i=0; i<hits; ++i) {
+        const double r = deviation[i] - (mean + slope * (at[i] - mean_t));
+        spread += r*r / (hits > 1 ? hits-1 : 1);
+    }
+    spread = sqrt(spread);
+
+    printf("  beats %zu, hit %zu, missed %zu, unclicked %zu, onsets %zu\n", beats, hits, beats - hits, unclicked, o->count);
+    printf("  mean %+.1f ms (%s), trend %+.2f ms/min, spread %.1f ms\n",
+        mean, (mean < -2.0) ? "rushing" : (mean > 2.0) ? "dragging" : "on the beat", slope, spread
+    );
+
+    // by quarter of the take, how the tendency moves
+    printf("  by quarter:");
+    for(int q=0; q<4; ++q) {
+        double sum = 0.0;
+        size_t count = 0;
+        for(size_t i=hits*q/4; i<hits*(q+1)/4; ++i) {
+            sum += deviation[i];
+            count++;
+        }
+        printf(count ? " %+.1f" : " -", sum / (count ? count : 1));
+    }
+    printf(" ms\n");
+
+    // 100 is every beat played with no spread, 20 ms of spread halves it
+    const double hit_rate = beats ? (double)hits / beats : 0.0;
+    printf("  stability %.0f/100\n", 100.0 * hit_rate * exp2(-spread / 20.0));
+
+    free(deviation);
+    free(at);
+}
+
+static void usage(const char *name) {
+    printf("usage: %s [-l latency_ms] [-v] session take.wav...\n", name);
+    printf("  -l  recording latency subtracted from every onset\n");
+    printf("  -v  list every beat\n");
+}
+
+int main(int argc, char **argv) {
+    double latency = 0.0;
+    uint8_t verbose = 0x0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "l:vh")) != -1) {
+        switch(opt) {
+            case 'l': latency = atof(optarg) / 1000.0; break;
+            case 'v': verbose = 0x1; break;
+            default:  usage(argv[0]); return 1;
+        }
+    }
+    if(optind+1 >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *session = argv[optind];
+
+    struct Metronome *m = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct Metronome));
+    struct Flux *f = aligned_alloc(16, sizeof(struct Flux));
+    int failed = 0;
+
+    for(int i=optind+1; i<argc; ++i) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        flux_init(f);
+        uint64_t frames = 0;
+        if(read_flux(argv[i], f, &frames) != 0) {
+            fprintf(stderr, "could not read %s\n", argv[i]);
+            failed = 1;
+            continue;
+        }
+
+        // the session is replayed for exactly as long as the take
+        metronome_init(m);
+        m->hosted = 0x1;
+        if(metronome_load(m, session) != 0) {
+            fprintf(stderr, "could not load %s\n", session);
+            metronome_track_free(m);
+            free(f->values);
+            free(f->energy);
+            failed = 1;
+            break;
+        }
+        struct Timeline timeline = {0};
+        metronome_timeline_build(m, UINT_MAX, frames, &timeline);
+
+        struct Onsets onsets = {0};
+        pick_onsets(f, &onsets);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%s: %.1fs analysed in %.3fs\n", argv[i], (double)frames / SAMPLE_RATE, seconds);
+        report(&timeline, &onsets, latency, verbose);
+
+        metronome_timeline_free(&timeline);
+        metronome_track_free(m);
+        free(onsets.seconds);
+        free(f->values);
+        free(f->energy);
+    }
+
+    free(f);
+    free(m);
+    return failed;
+}
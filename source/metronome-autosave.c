@@ -0,0 +1,244 @@
+#include "metronome-autosave.h"
+#include "metronome.h"
+#include "metronome-trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int write_all(const int fd, const char *data, size_t size) {
+    while(size > 0) {
+        const ssize_t count = write(fd, data, size);
+        if(count < 0 && errno == EINTR) { continue; }
+        if(count < 0) { return -1; }
+        data += count;
+        size -= count;
+    }
+    return 0;
+}
+
+// One line per edit with only the parts of the session it changed,
+// flushed to disk before the next edit is taken.
+static size_t append_journal(struct Autosave *a, const struct Session *s, const uint8_t parts) {
+    const int64_t begin_ns = metronome_trace_begin();
+    char *json = metronome_session_json(s, parts, 0x0);
+    const size_t size = strlen(json);
+    json[size] = '\n';
+
+    size_t written = 0;
+    if(write_all(a->fd, json, size+1) == 0) {
+        fdatasync(a->fd);
+        written = size+1;
+    }
+    free(json);
+    metronome_trace_span("io", "journal", begin_ns);
+    return written;
+}
+
+// Written next to the save file and renamed over it, a crash leaves
+// either the old file or the new one. The journal is only emptied after.
+// journaled is what the journal holds, 0 once it is emptied. One that
+// cannot be emptied gets the whole session appended, so playing it back
+// over the new save file ends where the save does.
+static void write_save(struct Autosave *a, const struct Session *s, size_t *journaled) {
+    const int64_t begin_ns = metronome_trace_begin();
+    char *json = metronome_session_json(s, SESSION_ALL, 0x1);
+    char tmp[sizeof(a->journal)];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", a->path);
+
+    const int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int failed = (fd < 0);
+    if(!failed) {
+        failed = write_all(fd, json, strlen(json)) != 0 || fsync(fd) != 0;
+        close(fd);
+    }
+    if(!failed && rename(tmp, a->path) == 0) {
+        if(ftruncate(a->fd, 0) == 0) {
+            *journaled = 0;
+        } else {
+            *journaled += append_journal(a, s, SESSION_ALL);
+        }
+    }
+    free(json);
+    metronome_trace_span("io", "autosave", begin_ns);
+}
+
+static void *autosave_main(void *arg) {
+    struct Autosave *a = arg;
+    struct Session *latest = NULL;  // taken and journaled, not in the save file yet
+    size_t journaled = 0;
+    metronome_trace_thread("autosave");
+
+    pthread_mutex_lock(&a->lock);
+    for(;;) {
+        if(a->pending) {
+            struct Session *s = a->pending;
+            a->pending = NULL;
+            pthread_mutex_unlock(&a->lock);
+            // against what was journaled last, posts in between coalesced
+            const uint8_t parts = metronome_session_diff(s, a->journaled);
+            if(parts) {
+                journaled += append_journal(a, s, parts);
+                memcpy(a->journaled, s, sizeof(*s));
+            }
+            free(latest);
+            latest = s;
+            pthread_mutex_lock(&a->lock);
+            continue;
+        }
+
+        const int64_t due_ns = a->posted_ns + (int64_t)a->debounce_ms * 1000000;
+        if(latest && (a->flush || !a->running || journaled > AUTOSAVE_JOURNAL_MAX || now_ns() >= due_ns)) {
+            a->flush = 0x0;
+            pthread_mutex_unlock(&a->lock);
+            // a journal that could not be emptied keeps counting towards
+            // the next save, which tries again
+            write_save(a, latest, &journaled);
+            free(latest);
+            latest = NULL;
+            pthread_mutex_lock(&a->lock);
+            continue;
+        }
+        if(!a->running) { break; }
+
+        if(latest) {
+            const struct timespec when = {due_ns / 1000000000, due_ns % 1000000000};
+            pthread_cond_timedwait(&a->wake, &a->lock, &when);
+        } else {
+            pthread_cond_wait(&a->wake, &a->lock);
+        }
+    }
+    pthread_mutex_unlock(&a->lock);
+    return NULL;
+}
+
+// The journal only ever holds edits newer than the save file, each line
+// the parts one of them changed. Played back in order over the loaded
+// save they give the session as it was when we went down.
+static int recover(struct Autosave *a) {
+    FILE *f = fopen(a->journal, "r");
+    if(f == NULL) { return 0; }
+
+    fseek(f, 0, SEEK_END);
+    const long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *buffer = malloc(size + 1);
+    const size_t count = fread(buffer, 1, size, f);
+    buffer[count] = '\0';
+    fclose(f);
+
+    // a torn last line is whatever came after the last newline
+    int recovered = 0;
+    char *line = buffer;
+    for(char *end = strchr(line, '\n'); end; end = strchr(line, '\n')) {
+        *end = '\0';
+        if(metronome_parse_parts(a->m, line) == 0) { recovered = 1; }
+        line = end+1;
+    }
+    free(buffer);
+    return recovered;
+}
+
+static void post(struct Autosave *a, const uint8_t flush) {
+    struct Session *s = malloc(sizeof(struct Session));
+    metronome_snapshot(a->m, s);
+    // a practice program moves bpm as it plays, that is not an edit
+    if(a->m->practice_active) {
+        s->bpm = a->last->bpm;
+    }
+    if(!flush && metronome_session_diff(s, a->last) == 0) {
+        free(s);
+        return;
+    }
+    memcpy(a->last, s, sizeof(*s));
+
+    pthread_mutex_lock(&a->lock);
+    struct Session *coalesced = a->pending;
+    a->pending = s;
+    a->posted_ns = now_ns();
+    a->flush |= flush;
+    pthread_cond_signal(&a->wake);
+    pthread_mutex_unlock(&a->lock);
+    free(coalesced);
+}
+
+// Returns 1 if the session was recovered from the journal, -1 on failure.
+int metronome_autosave_start(struct Autosave *a, struct Metronome *m, const char *path) {
+    a->m = m;
+    a->debounce_ms = AUTOSAVE_DEBOUNCE_MS;
+    a->pending = NULL;
+    a->posted_ns = 0;
+    a->flush = 0x0;
+    metronome_session_path(path, a->path, sizeof(a->path));
+    snprintf(a->journal, sizeof(a->journal), "%s.journal", a->path);
+
+    const int recovered = recover(a);
+    a->last = malloc(sizeof(struct Session));
+    a->journaled = malloc(sizeof(struct Session));
+    metronome_snapshot(m, a->last);
+    memcpy(a->journaled, a->last, sizeof(struct Session));
+
+    a->fd = open(a->journal, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(a->fd < 0) {
+        perror(a->journal);
+        free(a->last);
+        free(a->journaled);
+        return -1;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&a->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&a->lock, NULL);
+
+    a->running = 0x1;
+    if(pthread_create(&a->thread, NULL, autosave_main, a) != 0) {
+        close(a->fd);
+        free(a->last);
+        free(a->journaled);
+        return -1;
+    }
+    if(recovered) {
+        // bring the save file up to date with what was recovered
+        metronome_autosave_flush(a);
+    }
+    return recovered;
+}
+
+// Writes out whatever is still pending before it returns.
+void metronome_autosave_stop(struct Autosave *a) {
+    pthread_mutex_lock(&a->lock);
+    a->running = 0x0;
+    pthread_cond_signal(&a->wake);
+    pthread_mutex_unlock(&a->lock);
+    pthread_join(a->thread, NULL);
+
+    close(a->fd);
+    free(a->last);
+    free(a->journaled);
+    pthread_cond_destroy(&a->wake);
+    pthread_mutex_destroy(&a->lock);
+}
+
+// Call after edits. Costs a snapshot and a compare of the saved fields
+// when nothing changed, never waits on the disk.
+void metronome_autosave_post(struct Autosave *a) {
+    post(a, 0x0);
+}
+
+// :w, the save file is written as soon as the thread gets to it.
+void metronome_autosave_flush(struct Autosave *a) {
+    post(a, 0x1);
+}
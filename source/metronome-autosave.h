@@ -0,0 +1,43 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+struct Metronome;
+struct Session;
+
+#define AUTOSAVE_DEBOUNCE_MS    2000
+#define AUTOSAVE_JOURNAL_MAX    (256*1024)  // a bigger journal is folded into the save right away
+#define AUTOSAVE_PATH_SIZE      128
+
+// Saves the session on its own thread. The UI posts snapshots, a burst of
+// edits coalesces into whichever snapshot is newest when the thread gets
+// to it, and the parts of it that changed are appended to a journal next
+// to the save file at once.
+// The save file itself is only rewritten once edits have paused for
+// debounce_ms, after which the journal starts over.
+struct Autosave {
+    struct Metronome *m;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    uint32_t debounce_ms;
+    char path[AUTOSAVE_PATH_SIZE];
+    char journal[AUTOSAVE_PATH_SIZE+8];
+    int fd;                     // the journal, appended to by the thread only
+    struct Session *journaled;  // owned by the thread, the session as the journal has it
+
+    // owned by the UI thread, what it posted last
+    struct Session *last;
+
+    // guarded by lock
+    struct Session *pending;    // newest snapshot the thread has not taken yet
+    int64_t posted_ns;
+    uint8_t flush;              // write the save file without waiting
+    uint8_t running;
+};
+
+extern int metronome_autosave_start(struct Autosave *a, struct Metronome *m, const char *path);
+extern void metronome_autosave_stop(struct Autosave *a);
+extern void metronome_autosave_post(struct Autosave *a);
+extern void metronome_autosave_flush(struct Autosave *a);
@@ -0,0 +1,301 @@
+#include "metronome.h"
+
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHUNK_FRAMES    (4096)
+#define CHANNELS        (2)
+#define MAX_WORKERS     (64)
+#define MAX_SECONDS     (60*60)
+
+struct Batch {
+    char **sessions;
+    char **outputs;         // file name each session renders to, without .wav
+    int session_count;
+    const char *out_dir;
+    unsigned int loops;
+    unsigned int seconds;   // caps every session when set, endless programs are refused without it
+};
+
+// Every worker owns a deque of session indices [head, tail). It pops its
+// own work from the tail and idle workers steal half of someone else's
+// from the head, so a few long practice programs cannot leave cores idle.
+struct Worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int head;
+    int tail;
+
+    int id;
+    int worker_count;
+    struct Worker *workers;
+    const struct Batch *batch;
+
+    // the only memory a worker ever uses, whatever the session length
+    struct Metronome *m;
+    float chunk[CHUNK_FRAMES*CHANNELS];
+
+    uint64_t frames;
+    unsigned int rendered;
+    unsigned int failed;
+} CACHE_ALIGNED;
+
+static int pop_job(struct Worker *w) {
+    int job = -1;
+    pthread_mutex_lock(&w->lock);
+    if(w->head < w->tail) {
+        job = --w->tail;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return job;
+}
+
+static int steal_job(struct Worker *w) {
+    for(int i=1; i<w->worker_count; ++i) {
+        struct Worker *victim = &w->workers[(w->id + i) % w->worker_count];
+
+        pthread_mutex_lock(&victim->lock);
+        const int available = victim->tail - victim->head;
+        const int head = victim->head;
+        const int half = (available+1) / 2;
+        victim->head += half;
+        pthread_mutex_unlock(&victim->lock);
+
+        if(half > 0) {
+            pthread_mutex_lock(&w->lock);
+            w->head = head+1;
+            w->tail = head+half;
+            pthread_mutex_unlock(&w->lock);
+            return head;
+        }
+    }
+    return -1;
+}
+
+static uint8_t endless(const struct Metronome *m) {
+    for(uint8_t i=0; i<m->practice_count; ++i) {
+        if(m->practice[i].program != PROGRAM_NONE && m->practice[i].bars == 0) { return 0x1; }
+    }
+    return 0x0;
+}
+
+// Practice programs play until they stop themselves, plain tracks for
+// the requested number of loops after the count-in.
+static uint64_t session_frames(struct Metronome *m, const struct Batch *batch) {
+    if(batch->seconds > 0) {
+        return (uint64_t)batch->seconds * SAMPLE_RATE;
+    }
+    if(m->practice_count > 0) {
+        return (uint64_t)MAX_SECONDS * SAMPLE_RATE;
+    }
+    double count_in = 0.0;
+    if(m->count_in.beats > 0 && m->count_in.unit > 0) {
+        count_in = m->count_in.beats * 60.0 * (4.0/m->count_in.unit) * SAMPLE_RATE / BPM_FLOAT(m->bpm);
+    }
+    const struct TempoMap *map = metronome_tempo_map(m);
+    return (uint64_t)(count_in + map->measure_start[map->measure_count] * batch->loops + 0.5);
+}
+
+// The session's file name without its extension, suffixed with -2, -3...
+// while an earlier session already renders to it, as sessions of the same
+// name in different directories would overwrite each other's output.
+static char *output_name(char **taken, const int count, const char *session) {
+    char name[256];
+    snprintf(name, sizeof(name), "%s", session);
+    char *base = basename(name);
+    char *ext = strrchr(base, '.');
+    if(ext) { *ext = '\0'; }
+
+    char candidate[272];
+    snprintf(candidate, sizeof(candidate), "%s", base);
+    for(unsigned int n=2;; ++n) {
+        int i = 0;
+        while(i < count && strcmp(taken[i], candidate) != 0) { i++; }
+        if(i == count) { break; }
+        snprintf(candidate, sizeof(candidate), "%s-%u", base, n);
+    }
+    if(strcmp(candidate, base) != 0) {
+        fprintf(stderr, "%s renders to %s.wav, %s.wav is taken\n", session, candidate, base);
+    }
+    return strdup(candidate);
+}
+
+static int render_session(struct Worker *w, const char *session, const char *output) {
+    struct Metronome *m = w->m;
+    metronome_init(m);
+    m->hosted = 0x1;
+    if(metronome_load(m, session) != 0) {
+        fprintf(stderr, "[%d] could not load %s\n", w->id, session);
+        return -1;
+    }
+    if(endless(m) && w->batch->seconds == 0) {
+        fprintf(stderr, "[%d] %s never ends, give its length with -s\n", w->id, session);
+        return -1;
+    }
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s.wav", w->batch->out_dir, output);
+
+    ma_encoder encoder;
+    ma_encoder_config config = ma_encoder_config_init(ma_encoding_format_wav, ma_format_f32, CHANNELS, SAMPLE_RATE);
+    if(ma_encoder_init_file(path, &config, &encoder) != MA_SUCCESS) {
+        fprintf(stderr, "[%d] could not create %s\n", w->id, path);
+        return -1;
+    }
+
+    uint64_t remaining = session_frames(m, w->batch);
+    if(m->practice_count > 0) {
+        m->practice_autostop = 0x1;
+        metronome_practice_start(m, 0);
+    }
+    metronome_start(m);
+
+    while(remaining > 0 && m->state != METRONOME_STOPPED) {
+        const uint32_t frames = (remaining < CHUNK_FRAMES) ? remaining : CHUNK_FRAMES;
+        memset(w->chunk, 0, sizeof(w->chunk));
+        metronome_render(m, w->chunk, frames, CHANNELS);
+
+        ma_uint64 written = 0;
+        if(ma_encoder_write_pcm_frames(&encoder, w->chunk, frames, &written) != MA_SUCCESS || written != frames) {
+            fprintf(stderr, "[%d] could not write %s\n", w->id, path);
+            ma_encoder_uninit(&encoder);
+            remove(path);
+            return -1;
+        }
+        remaining -= frames;
+        w->frames += frames;
+    }
+    if(remaining == 0 && m->practice_count > 0 && w->batch->seconds == 0) {
+        fprintf(stderr, "[%d] %s still playing after %ds, cut short\n", w->id, session, MAX_SECONDS);
+    }
+    ma_encoder_uninit(&encoder);
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    struct Worker *w = arg;
+    for(;;) {
+        int job = pop_job(w);
+        if(job < 0) { job = steal_job(w); }
+        if(job < 0) { break; }
+
+        if(render_session(w, w->batch->sessions[job], w->batch->outputs[job]) == 0) {
+            w->rendered++;
+        } else {
+            w->failed++;
+        }
+        metronome_track_free(w->m);
+    }
+    return NULL;
+}
+
+static void usage(const char *name) {
+    printf("usage: %s [-j threads] [-l loops] [-s seconds] -o out_dir session...\n", name);
+    printf("  -s  render every session for this long, needed for endless programs\n");
+}
+
+int main(int argc, char **argv) {
+    struct Batch batch = {.out_dir = NULL, .loops = 4, .seconds = 0};
+    long worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while((opt = getopt(argc, argv, "j:l:o:s:h")) != -1) {
+        switch(opt) {
+            case 'j': worker_count = atoi(optarg); break;
+            case 'l': batch.loops = atoi(optarg); break;
+            case 'o': batch.out_dir = optarg; break;
+            case 's': batch.seconds = atoi(optarg); break;
+            default:  usage(argv[0]); return 1;
+        }
+    }
+    if(batch.out_dir == NULL || optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    batch.sessions = &argv[optind];
+    batch.session_count = argc - optind;
+
+    batch.outputs = calloc(batch.session_count, sizeof(char *));
+    if(batch.outputs == NULL) {
+        perror("outputs");
+        return 1;
+    }
+    for(int i=0; i<batch.session_count; ++i) {
+        batch.outputs[i] = output_name(batch.outputs, i, batch.sessions[i]);
+        if(batch.outputs[i] == NULL) {
+            perror("outputs");
+            return 1;
+        }
+    }
+
+    if(worker_count < 1) { worker_count = 1; }
+    if(worker_count > MAX_WORKERS) { worker_count = MAX_WORKERS; }
+    if(worker_count > batch.session_count) { worker_count = batch.session_count; }
+
+    struct Worker *workers = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct Worker) * worker_count);
+    if(workers == NULL) {
+        perror("workers");
+        return 1;
+    }
+    for(int i=0; i<worker_count; ++i) {
+        struct Worker *w = &workers[i];
+        pthread_mutex_init(&w->lock, NULL);
+        w->head = batch.session_count *  i    / worker_count;
+        w->tail = batch.session_count * (i+1) / worker_count;
+        w->id = i;
+        w->worker_count = worker_count;
+        w->workers = workers;
+        w->batch = &batch;
+        w->m = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct Metronome));
+        if(w->m == NULL) {
+            perror("workers");
+            return 1;
+        }
+        w->frames = 0;
+        w->rendered = 0;
+        w->failed = 0;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i=0; i<worker_count; ++i) {
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
+
+    uint64_t frames = 0;
+    unsigned int rendered = 0;
+    unsigned int failed = 0;
+    for(int i=0; i<worker_count; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        frames   += workers[i].frames;
+        rendered += workers[i].rendered;
+        failed   += workers[i].failed;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    const double audio = (double)frames / SAMPLE_RATE;
+    printf("rendered %u sessions (%u failed) on %ld workers in %.3fs\n", rendered, failed, worker_count, seconds);
+    printf("%.1fs of audio, %.1fx realtime, %.1f MB/s written\n",
+        audio,
+        audio / seconds,
+        frames * CHANNELS * sizeof(float) / seconds / (1024.0*1024.0)
+    );
+    for(int i=0; i<worker_count; ++i) {
+        printf("  worker %2d: %4u sessions %8.1fs of audio\n", i, workers[i].rendered, (double)workers[i].frames / SAMPLE_RATE);
+        pthread_mutex_destroy(&workers[i].lock);
+        free(workers[i].m);
+    }
+    free(workers);
+    for(int i=0; i<batch.session_count; ++i) {
+        free(batch.outputs[i]);
+    }
+    free(batch.outputs);
+
+    return failed > 0 ? 1 : 0;
+}
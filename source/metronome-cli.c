@@ -1,4 +1,9 @@
 #include "metronome.h"
+#include "metronome-control.h"
+#include "metronome-status.h"
+#include "metronome-sync.h"
+#include "metronome-tap.h"
+#include "metronome-trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,31 +30,90 @@ void disable_non_canonical_mode() {
 }
 
 int main (int argc, char **argv) {
+    // tracing starts before setup so it sees the device open
+    const char *trace_path = NULL;
+    for(int i=1; i+1<argc; ++i) {
+        if(strcmp(argv[i], "--trace") == 0) { trace_path = argv[i+1]; }
+    }
+    if(trace_path && metronome_trace_open() != 0) {
+        trace_path = NULL;
+    }
+    metronome_trace_thread("ui");
+
     struct Metronome metronome;
-    metronome_setup(&metronome);
+    ma_result opened = metronome_setup(&metronome);
+
+    metronome.bpm=BPM(120); 
+    metronome.base_bpm=BPM(120); 
 
-    metronome.bpm=120; 
-    metronome.base_bpm=120.0; 
+    // usage: metronome-cli [--socket path] [--status shm-name] [--sync port] [--realtime] [--idle seconds] [--trace out.json] [bpm]
+    const char *socket_path = NULL;
+    const char *status_name = NULL;
+    int sync_port = 0;
+    for(int i=1; i<argc; ++i) {
+        if(strcmp(argv[i], "--socket") == 0 && i+1 < argc) {
+            socket_path = argv[++i];
+        } else if(strcmp(argv[i], "--status") == 0 && i+1 < argc) {
+            status_name = argv[++i];
+        } else if(strcmp(argv[i], "--sync") == 0 && i+1 < argc) {
+            sync_port = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--trace") == 0 && i+1 < argc) {
+            ++i;
+        } else if(strcmp(argv[i], "--idle") == 0 && i+1 < argc) {
+            metronome.idle_ms = atof(argv[++i]) * 1000;
+        } else if(strcmp(argv[i], "--realtime") == 0) {
+            char granted[64];
+            metronome_realtime_describe(metronome_realtime(&metronome), granted, sizeof(granted));
+            printf("realtime: %s, fifo is asked for on start\n", granted);
+        } else {
+            metronome_set_bpm(&metronome, atof(argv[i]));
+        }
+    }
+
+    // the device has been opening while the arguments were read
+    if(opened == MA_SUCCESS) {
+        opened = metronome_wait_device(&metronome);
+    }
+    if(opened != MA_SUCCESS) {
+        fprintf(stderr, "could not open the playback device: %s\n", ma_result_description(opened));
+        metronome_shutdown(&metronome);
+        return 1;
+    }
 
-    if(argc > 1) {
-        metronome.bpm = atoi(argv[1]);
+    static struct ControlServer control;
+    if(socket_path && metronome_control_start(&control, &metronome, socket_path) != 0) {
+        socket_path = NULL;
+    }
+    if(status_name && metronome_status_open(&metronome, status_name) != 0) {
+        status_name = NULL;
+    }
+    static struct SyncServer peers;
+    if(sync_port > 0 && metronome_sync_start(&peers, &metronome, sync_port) != 0) {
+        sync_port = 0;
     }
 
     enable_non_canonical_mode();
 
 
-    printf("Metronome running at %d BPM.\n", metronome.bpm);
+    printf("Metronome running at %g BPM.\n", BPM_FLOAT(metronome.bpm));
 
+    struct TapTempo tap = {0};
     char input_char;
     char keep_running = 0x1;
     while(keep_running == 0x1) {
         if(read(STDIN_FILENO, &input_char, 1) == 1) {
+            const int64_t read_ns = metronome_tap_now();
+            const char key[] = {'k','e','y',' ', input_char, '\0'};
+            metronome_trace_instant("ui", key);
             switch(input_char) {
                 case '+':
-                    metronome.bpm++;
+                    metronome_inc_bpm(&metronome);
                     break;
                 case '-':
-                    metronome.bpm--;
+                    metronome_dec_bpm(&metronome);
+                    break;
+                case 't':
+                    metronome_tap(&metronome, &tap, read_ns);
                     break;
                 case ':':
                     printf(":");
@@ -60,7 +124,7 @@ int main (int argc, char **argv) {
                         printf("new bpm: ");
                         char value[128];
                         fscanf(stdin, "%s", value);
-                        metronome.bpm = atoi(value);
+                        metronome_set_bpm(&metronome, atof(value));
                         metronome.base_bpm = metronome.bpm;
                         //metronome.next_step = metronome.interval;
                     } else if (strcmp(cmd, "interval") == 0) {
@@ -88,12 +152,26 @@ int main (int argc, char **argv) {
                     break;
             }
             system("clear");
-            printf("Metronome running at %d BPM.\n", metronome.bpm);
+            printf("Metronome running at %g BPM.\n", BPM_FLOAT(metronome.bpm));
         }
         usleep(1000);
     }
 
+    // everything that reads or drives the engine goes before the engine
+    if(socket_path) {
+        metronome_control_stop(&control);
+    }
+    if(sync_port > 0) {
+        metronome_sync_stop(&peers);
+    }
+    if(status_name) {
+        metronome_status_close(&metronome, status_name);
+    }
     metronome_shutdown(&metronome);
+    if(trace_path) {
+        metronome_trace_write(trace_path);
+        metronome_trace_close();
+    }
 
     return 0;
 }
@@ -0,0 +1,337 @@
+#include "metronome-control.h"
+#include "metronome.h"
+#include "metronome-trace.h"
+
+#include <cJSON.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// poll timeouts in ms, short while someone listens for beats
+#define SUBSCRIBED_TIMEOUT  (2)
+#define IDLE_TIMEOUT        (50)
+
+static void client_close(struct ControlClient *c) {
+    close(c->fd);
+    c->fd = -1;
+    c->subscribed = 0x0;
+    c->in_len = 0;
+    c->out_len = 0;
+}
+
+// Queues a line for the client, a client too slow to keep up is dropped
+// rather than letting it hold up the loop.
+static void client_send(struct ControlClient *c, const char *line) {
+    const size_t len = strlen(line);
+    if(c->out_len + len + 1 > CONTROL_OUT_SIZE) {
+        client_close(c);
+        return;
+    }
+    memcpy(&c->out[c->out_len], line, len);
+    c->out[c->out_len + len] = '\n';
+    c->out_len += len + 1;
+}
+
+static void client_flush(struct ControlClient *c) {
+    if(c->fd < 0 || c->out_len == 0) { return; }
+
+    const ssize_t written = write(c->fd, c->out, c->out_len);
+    if(written < 0) {
+        if(errno != EAGAIN && errno != EWOULDBLOCK) { client_close(c); }
+        return;
+    }
+    memmove(c->out, &c->out[written], c->out_len - written);
+    c->out_len -= written;
+}
+
+static uint8_t parse_quantize(const cJSON *cmd) {
+    const cJSON *q = cJSON_GetObjectItemCaseSensitive(cmd, "quantize");
+    if(cJSON_IsString(q)) {
+        if(strcmp(q->valuestring, "beat") == 0) { return QUANTIZE_BEAT; }
+        if(strcmp(q->valuestring, "bar") == 0)  { return QUANTIZE_BAR; }
+    }
+    return QUANTIZE_NOW;
+}
+
+static void add_status(cJSON *reply, const struct Metronome *m) {
+    const struct Measure *measure = &m->track.measures[m->track.active_measure];
+    cJSON_AddNumberToObject(reply, "bpm", BPM_FLOAT(m->bpm));
+    cJSON_AddNumberToObject(reply, "state", m->state);
+    cJSON_AddNumberToObject(reply, "measure", m->track.active_measure+1);
+    cJSON_AddNumberToObject(reply, "beat", m->tick);
+    cJSON_AddNumberToObject(reply, "beats", measure->beats);
+    cJSON_AddNumberToObject(reply, "unit", measure->unit);
+}
+
+static cJSON *handle_command(struct ControlServer *s, struct ControlClient *c, const cJSON *cmd) {
+    struct Metronome *m = s->m;
+    const int64_t begin_ns = metronome_trace_begin();
+    cJSON *reply = cJSON_CreateObject();
+
+    const cJSON *id = cJSON_GetObjectItemCaseSensitive(cmd, "id");
+    if(cJSON_IsNumber(id)) {
+        cJSON_AddNumberToObject(reply, "id", id->valuedouble);
+    }
+
+    const cJSON *name = cJSON_GetObjectItemCaseSensitive(cmd, "cmd");
+    if(!cJSON_IsString(name)) {
+        cJSON_AddBoolToObject(reply, "ok", 0);
+        cJSON_AddStringToObject(reply, "error", "missing cmd");
+        return reply;
+    }
+
+    const char *error = NULL;
+    if(strcmp(name->valuestring, "tempo") == 0) {
+        const cJSON *bpm = cJSON_GetObjectItemCaseSensitive(cmd, "bpm");
+        if(cJSON_IsNumber(bpm) && bpm->valuedouble > 0.0) {
+            if(metronome_queue_change(m, BPM(bpm->valuedouble), 0, 0, parse_quantize(cmd)) != 0) {
+                error = "too many changes queued";
+            }
+        } else {
+            error = "tempo needs bpm";
+        }
+    } else if(strcmp(name->valuestring, "signature") == 0) {
+        const cJSON *beats = cJSON_GetObjectItemCaseSensitive(cmd, "beats");
+        const cJSON *unit  = cJSON_GetObjectItemCaseSensitive(cmd, "unit");
+        if(cJSON_IsNumber(beats) && cJSON_IsNumber(unit) && beats->valueint > 0 && unit->valueint > 0) {
+            if(metronome_queue_change(m, 0, beats->valueint, unit->valueint, parse_quantize(cmd)) != 0) {
+                error = "too many changes queued";
+            }
+        } else {
+            error = "signature needs beats and unit";
+        }
+    } else if(strcmp(name->valuestring, "start") == 0) {
+        m->reset = 0x1;
+        m->tick = 1;
+        metronome_start(m);
+    } else if(strcmp(name->valuestring, "stop") == 0) {
+        metronome_stop(m);
+    } else if(strcmp(name->valuestring, "seek") == 0) {
+        const cJSON *measure = cJSON_GetObjectItemCaseSensitive(cmd, "measure");
+        const cJSON *beat = cJSON_GetObjectItemCaseSensitive(cmd, "beat");
+        if(cJSON_IsNumber(measure) && measure->valueint > 0) {
+            metronome_seek(m, measure->valueint-1, (cJSON_IsNumber(beat) && beat->valueint > 0) ? beat->valueint-1 : 0);
+        } else {
+            error = "seek needs measure";
+        }
+    } else if(strcmp(name->valuestring, "load") == 0) {
+        const cJSON *path = cJSON_GetObjectItemCaseSensitive(cmd, "path");
+        if(cJSON_IsString(path)) {
+            const uint8_t running = (m->state != METRONOME_STOPPED);
+            metronome_stop(m);
+            if(metronome_load(m, path->valuestring) != 0) {
+                error = "could not load session";
+            }
+            m->reset = 0x1;
+            m->tick = 1;
+            if(running) { metronome_start(m); }
+        } else {
+            error = "load needs path";
+        }
+    } else if(strcmp(name->valuestring, "tap") == 0) {
+        const bpm_t bpm = metronome_tap(m, &s->tap, c->read_ns);
+        cJSON_AddNumberToObject(reply, "taps", s->tap.taps);
+        if(bpm > 0) { cJSON_AddNumberToObject(reply, "bpm", BPM_FLOAT(bpm)); }
+    } else if(strcmp(name->valuestring, "subscribe") == 0) {
+        c->subscribed = 0x1;
+    } else if(strcmp(name->valuestring, "unsubscribe") == 0) {
+        c->subscribed = 0x0;
+    } else if(strcmp(name->valuestring, "status") == 0) {
+        add_status(reply, m);
+    } else {
+        error = "unknown cmd";
+    }
+
+    cJSON_AddBoolToObject(reply, "ok", error == NULL);
+    if(error) {
+        cJSON_AddStringToObject(reply, "error", error);
+    }
+    metronome_trace_span("command", name->valuestring, begin_ns);
+    return reply;
+}
+
+// A line holds one command object or an array of them, a batch is
+// answered with one array so its replies arrive together.
+static void handle_line(struct ControlServer *s, struct ControlClient *c, const char *line) {
+    cJSON *json = cJSON_Parse(line);
+    cJSON *reply = NULL;
+    if(json == NULL) {
+        reply = cJSON_CreateObject();
+        cJSON_AddBoolToObject(reply, "ok", 0);
+        cJSON_AddStringToObject(reply, "error", "invalid json");
+    } else if(cJSON_IsArray(json)) {
+        reply = cJSON_CreateArray();
+        const cJSON *cmd;
+        cJSON_ArrayForEach(cmd, json) {
+            cJSON_AddItemToArray(reply, handle_command(s, c, cmd));
+        }
+    } else {
+        reply = handle_command(s, c, json);
+    }
+
+    char *str = cJSON_PrintUnformatted(reply);
+    client_send(c, str);
+    cJSON_free(str);
+    cJSON_Delete(reply);
+    cJSON_Delete(json);
+}
+
+static void client_read(struct ControlServer *s, struct ControlClient *c) {
+    const ssize_t count = read(c->fd, &c->in[c->in_len], CONTROL_IN_SIZE - c->in_len - 1);
+    c->read_ns = metronome_tap_now();
+    if(count <= 0) {
+        if(count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) { client_close(c); }
+        return;
+    }
+    c->in_len += count;
+    c->in[c->in_len] = '\0';
+
+    char *start = c->in;
+    char *end;
+    while(c->fd >= 0 && (end = strchr(start, '\n')) != NULL) {
+        *end = '\0';
+        if(end > start) { handle_line(s, c, start); }
+        start = end+1;
+    }
+    if(c->fd < 0) { return; }
+
+    c->in_len -= start - c->in;
+    memmove(c->in, start, c->in_len);
+    if(c->in_len >= CONTROL_IN_SIZE-1) {
+        // a single line that does not fit is never going to parse
+        client_close(c);
+    }
+}
+
+static void publish_beats(struct ControlServer *s) {
+    struct BeatEvent events[BEAT_EVENTS];
+    const uint32_t tail = s->beat_tail;
+    s->beat_tail = metronome_read_beats(s->m, tail, events, BEAT_EVENTS);
+    const uint32_t count = s->beat_tail - tail;
+
+    for(uint32_t i=0; i<count && i<BEAT_EVENTS; ++i) {
+        char line[160];
+        snprintf(line, sizeof(line),
+            "{\"event\":\"beat\",\"measure\":%u,\"beat\":%u,\"count_in\":%s,\"bpm\":%g,\"frame\":%llu}",
+            events[i].measure+1, events[i].beat+1, events[i].count_in ? "true" : "false", BPM_FLOAT(events[i].bpm), (unsigned long long)events[i].frame
+        );
+        for(int k=0; k<MAX_CONTROL_CLIENTS; ++k) {
+            struct ControlClient *c = &s->clients[k];
+            if(c->fd >= 0 && c->subscribed) { client_send(c, line); }
+        }
+    }
+}
+
+static void *control_loop(void *arg) {
+    struct ControlServer *s = arg;
+    struct pollfd fds[MAX_CONTROL_CLIENTS+1];
+    metronome_trace_thread("control");
+
+    while(__atomic_load_n(&s->running, __ATOMIC_ACQUIRE)) {
+        uint8_t subscribed = 0x0;
+        fds[0].fd = s->fd;
+        fds[0].events = POLLIN;
+        for(int i=0; i<MAX_CONTROL_CLIENTS; ++i) {
+            const struct ControlClient *c = &s->clients[i];
+            fds[i+1].fd = c->fd;
+            fds[i+1].events = POLLIN | (c->out_len > 0 ? POLLOUT : 0);
+            fds[i+1].revents = 0;
+            subscribed |= (c->fd >= 0 && c->subscribed);
+        }
+
+        poll(fds, MAX_CONTROL_CLIENTS+1, subscribed ? SUBSCRIBED_TIMEOUT : IDLE_TIMEOUT);
+
+        if(fds[0].revents & POLLIN) {
+            const int fd = accept(s->fd, NULL, NULL);
+            if(fd >= 0) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                int slot = -1;
+                for(int i=0; i<MAX_CONTROL_CLIENTS && slot<0; ++i) {
+                    if(s->clients[i].fd < 0) { slot = i; }
+                }
+                if(slot < 0) {
+                    close(fd);
+                } else {
+                    s->clients[slot].fd = fd;
+                }
+            }
+        }
+        for(int i=0; i<MAX_CONTROL_CLIENTS; ++i) {
+            struct ControlClient *c = &s->clients[i];
+            if(c->fd >= 0 && fds[i+1].fd == c->fd && (fds[i+1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                client_read(s, c);
+            }
+        }
+
+        if(subscribed) {
+            publish_beats(s);
+        } else {
+            // nobody listens, start from the current beat on the next subscribe
+            s->beat_tail = __atomic_load_n(&s->m->beat_head, __ATOMIC_ACQUIRE);
+        }
+
+        for(int i=0; i<MAX_CONTROL_CLIENTS; ++i) {
+            client_flush(&s->clients[i]);
+        }
+    }
+    return NULL;
+}
+
+int metronome_control_start(struct ControlServer *s, struct Metronome *m, const char *path) {
+    s->m = m;
+    s->beat_tail = m->beat_head;
+    memset(&s->tap, 0, sizeof(s->tap));
+    for(int i=0; i<MAX_CONTROL_CLIENTS; ++i) {
+        s->clients[i].fd = -1;
+        s->clients[i].subscribed = 0x0;
+        s->clients[i].in_len = 0;
+        s->clients[i].out_len = 0;
+    }
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "control socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    strcpy(s->path, path);
+
+    s->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(s->fd < 0) {
+        perror("control socket");
+        return -1;
+    }
+    unlink(path);
+    if(bind(s->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(s->fd, 8) != 0) {
+        perror("control socket");
+        close(s->fd);
+        return -1;
+    }
+    fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK);
+
+    s->running = 0x1;
+    if(pthread_create(&s->thread, NULL, control_loop, s) != 0) {
+        close(s->fd);
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+void metronome_control_stop(struct ControlServer *s) {
+    __atomic_store_n(&s->running, 0x0, __ATOMIC_RELEASE);
+    pthread_join(s->thread, NULL);
+
+    for(int i=0; i<MAX_CONTROL_CLIENTS; ++i) {
+        if(s->clients[i].fd >= 0) { client_close(&s->clients[i]); }
+    }
+    close(s->fd);
+    unlink(s->path);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "metronome-tap.h"
+
+struct Metronome;
+
+#define MAX_CONTROL_CLIENTS     32
+#define CONTROL_IN_SIZE         4096
+#define CONTROL_OUT_SIZE        16384
+
+struct ControlClient {
+    int fd;
+    uint8_t subscribed;
+    int64_t read_ns;    // when the lines being handled came off the socket
+    size_t in_len;
+    size_t out_len;
+    char in[CONTROL_IN_SIZE];
+    char out[CONTROL_OUT_SIZE];
+};
+
+// Line-delimited JSON over a unix socket, every client served from one
+// poll() loop on its own thread.
+struct ControlServer {
+    struct Metronome *m;
+    int fd;
+    pthread_t thread;
+    uint8_t running;
+    uint32_t beat_tail;
+    struct TapTempo tap;    // shared, any client may tap along
+    char path[108];
+    struct ControlClient clients[MAX_CONTROL_CLIENTS];
+};
+
+extern int metronome_control_start(struct ControlServer *s, struct Metronome *m, const char *path);
+extern void metronome_control_stop(struct ControlServer *s);
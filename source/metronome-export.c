@@ -0,0 +1,258 @@
+#include "metronome.h"
+#include "metronome-timeline.h"
+
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SECONDS         (60*60)
+
+#define PPQ                 (960)
+#define CLOCKS_PER_QUARTER  (24)
+#define CLICK_TICKS         (PPQ/8)
+#define MAX_TEMPO           (0xffffff)
+#define LOOKAHEAD           (16)
+#define TOLERANCE           (1e6 / SAMPLE_RATE)  // a sample, in microseconds
+
+struct Chunk {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    uint64_t tick;      // of the last event written
+};
+
+static void put(struct Chunk *c, const void *bytes, const size_t size) {
+    if(c->size + size > c->capacity) {
+        c->capacity = (c->capacity + size) * 2;
+        c->data = realloc(c->data, c->capacity);
+    }
+    memcpy(&c->data[c->size], bytes, size);
+    c->size += size;
+}
+
+static void put_event(struct Chunk *c, const uint64_t tick, const uint8_t *bytes, const size_t size) {
+    // delta time as a variable length quantity, 7 bits per byte
+    uint64_t delta = tick - c->tick;
+    uint8_t vlq[10];
+    int n = 0;
+    vlq[n++] = delta & 0x7f;
+    while(delta >>= 7) {
+        vlq[n++] = 0x80 | (delta & 0x7f);
+    }
+    while(n > 0) {
+        put(c, &vlq[--n], 1);
+    }
+    put(c, bytes, size);
+    c->tick = tick;
+}
+
+static void put_text(struct Chunk *c, const uint64_t tick, const uint8_t type, const char *text) {
+    uint8_t event[3+64] = {0xff, type, (uint8_t)strlen(text)};
+    memcpy(&event[3], text, event[2]);
+    put_event(c, tick, event, 3 + event[2]);
+}
+
+static uint8_t log2_unit(uint8_t unit) {
+    uint8_t power = 0;
+    while(unit >>= 1) { power++; }
+    return power;
+}
+
+// microseconds from the start to beat k, the end for k == count
+static double beat_time(const struct Timeline *t, const size_t k) {
+    return ((k < t->count) ? t->beats[k].frame : t->end) * 1e6 / SAMPLE_RATE;
+}
+
+static uint32_t fit_tempo(const double microseconds, const double quarters) {
+    return fmax(1.0, fmin(round(microseconds / quarters), MAX_TEMPO));
+}
+
+// Track 0 carries the meter and tempo map, track 1 a click at the pitch
+// and level of every beat's voice. Tempo is integer microseconds per
+// quarter, so each value is chosen to land the next beat on its exact
+// time. The rounding never accumulates, and a steady tempo keeps one
+// value as long as it stays within a sample of the real timeline.
+static int write_smf(const struct Metronome *m, const struct Timeline *t, const char *path) {
+    struct Chunk map = {0}, click = {0};
+    put_text(&map, 0, 0x03, "Tempo map");
+    put_text(&click, 0, 0x03, "Click");
+
+    uint64_t tick = 0;
+    double emitted = 0.0;   // microseconds the tempo events so far add up to
+    uint32_t tempo = 0;
+    uint8_t beats = 0, unit = 0, count_in = 0x0;
+
+    for(size_t k=0; k<t->count; ++k) {
+        const struct TimelineBeat *beat = &t->beats[k];
+        const struct Measure *measure = metronome_timeline_measure(m, beat);
+        const double quarters = 4.0 / measure->unit;
+
+        if(beat->beat == 0 || k == 0) {
+            if(measure->beats != beats || measure->unit != unit) {
+                beats = measure->beats;
+                unit  = measure->unit;
+                const uint8_t signature[] = {0xff, 0x58, 0x04, beats, log2_unit(unit), CLOCKS_PER_QUARTER * 4 / unit, 8};
+                put_event(&map, tick, signature, sizeof(signature));
+            }
+            if(beat->count_in != count_in || k == 0) {
+                count_in = beat->count_in;
+                put_text(&map, tick, 0x06, count_in ? "Count-in" : "Track");
+            }
+        }
+
+        const double target = beat_time(t, k+1);
+        if(tempo == 0 || fabs(emitted + tempo*quarters - target) > TOLERANCE) {
+            // the average over the beats ahead keeps a steady tempo on one
+            // value through the engine's whole-sample rounding, a ramp
+            // falls back to fitting this beat alone
+            const size_t ahead = (k+LOOKAHEAD < t->count) ? LOOKAHEAD : t->count - k;
+            uint32_t candidate = fit_tempo(beat_time(t, k+ahead) - emitted, quarters * ahead);
+            if(fabs(emitted + candidate*quarters - target) > TOLERANCE) {
+                candidate = fit_tempo(target - emitted, quarters);
+            }
+            if(candidate != tempo) {
+                tempo = candidate;
+                const uint8_t event[] = {0xff, 0x51, 0x03, tempo >> 16, tempo >> 8, tempo};
+                put_event(&map, tick, event, sizeof(event));
+            }
+        }
+        emitted += tempo * quarters;
+
+        // bars the practice program dropped keep their time, not their notes
+        const struct Click *voice = &measure->clicks[beat->beat];
+        if(voice->gain > 0.f && !beat->silent) {
+            const double frequency = voice->phase_step * SAMPLE_RATE / (2.0 * M_PI);
+            const uint8_t note = fmax(0.0, fmin(127.0, round(69.0 + 12.0 * log2(frequency / 440.0))));
+            const uint8_t velocity = fmax(1.0, fmin(127.0, voice->gain * 2.f * 127.f));
+            const uint8_t on[]  = {0x90, note, velocity};
+            const uint8_t off[] = {0x80, note, 0};
+            put_event(&click, tick, on, sizeof(on));
+            put_event(&click, tick + CLICK_TICKS, off, sizeof(off));
+        }
+        tick += PPQ * quarters;
+    }
+    const uint8_t end_of_track[] = {0xff, 0x2f, 0x00};
+    put_event(&map, tick, end_of_track, sizeof(end_of_track));
+    put_event(&click, tick, end_of_track, sizeof(end_of_track));
+
+    FILE *file = fopen(path, "wb");
+    if(file == NULL) {
+        perror(path);
+        free(map.data);
+        free(click.data);
+        return -1;
+    }
+    const uint8_t header[] = {'M','T','h','d', 0,0,0,6, 0,1, 0,2, PPQ >> 8, PPQ & 0xff};
+    fwrite(header, 1, sizeof(header), file);
+    const struct Chunk *tracks[] = {&map, &click};
+    for(int i=0; i<2; ++i) {
+        const uint32_t size = tracks[i]->size;
+        const uint8_t chunk[] = {'M','T','r','k', size >> 24, size >> 16, size >> 8, size};
+        fwrite(chunk, 1, sizeof(chunk), file);
+        fwrite(tracks[i]->data, 1, size, file);
+    }
+    const int failed = ferror(file);
+    fclose(file);
+    free(map.data);
+    free(click.data);
+    return failed ? -1 : 0;
+}
+
+static int write_byte(const int fd, const uint8_t byte) {
+    while(write(fd, &byte, 1) != 1) {
+        if(errno != EINTR) { return -1; }
+    }
+    return 0;
+}
+
+// Start, a 24 PPQN clock interpolated inside every beat between its exact
+// frames, and stop. Paced, each byte is written at its time from the
+// start of the stream, otherwise the whole stream goes out at once.
+static int stream_clock(const struct Metronome *m, const struct Timeline *t, const int fd, const uint8_t paced) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if(write_byte(fd, 0xfa) != 0) { return -1; }
+    for(size_t k=0; k<t->count; ++k) {
+        const struct Measure *measure = metronome_timeline_measure(m, &t->beats[k]);
+        const uint32_t clocks = CLOCKS_PER_QUARTER * 4 / measure->unit;
+        const double from = t->beats[k].frame;
+        const double to = (k+1 < t->count) ? t->beats[k+1].frame : t->end;
+
+        for(uint32_t j=0; j<clocks; ++j) {
+            if(paced) {
+                const double seconds = (from + (to - from) * j / clocks) / SAMPLE_RATE;
+                const int64_t ns = start.tv_nsec + (int64_t)(seconds * 1e9);
+                const struct timespec when = {start.tv_sec + ns / 1000000000, ns % 1000000000};
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL);
+            }
+            if(write_byte(fd, 0xf8) != 0) { return -1; }
+        }
+    }
+    return write_byte(fd, 0xfc);
+}
+
+static void usage(const char *name) {
+    printf("usage: %s [-l loops] [-s out.mid] [-c fd|-] [-r] session\n", name);
+    printf("  -s  write a type 1 standard midi file\n");
+    printf("  -c  stream midi clock to a file descriptor, - for stdout\n");
+    printf("  -r  pace the clock in real time\n");
+}
+
+int main(int argc, char **argv) {
+    unsigned int loops = 1;
+    const char *smf_path = NULL;
+    int clock_fd = -1;
+    uint8_t paced = 0x0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "l:s:c:rh")) != -1) {
+        switch(opt) {
+            case 'l': loops = atoi(optarg); break;
+            case 's': smf_path = optarg; break;
+            case 'c': clock_fd = (strcmp(optarg, "-") == 0) ? STDOUT_FILENO : atoi(optarg); break;
+            case 'r': paced = 0x1; break;
+            default:  usage(argv[0]); return 1;
+        }
+    }
+    if(optind >= argc || (smf_path == NULL && clock_fd < 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct Metronome *m = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct Metronome));
+    metronome_init(m);
+    m->hosted = 0x1;
+    if(metronome_load(m, argv[optind]) != 0) {
+        fprintf(stderr, "could not load %s\n", argv[optind]);
+        metronome_track_free(m);
+        free(m);
+        return 1;
+    }
+
+    struct Timeline timeline = {0};
+    metronome_timeline_build(m, loops, (uint64_t)MAX_SECONDS * SAMPLE_RATE, &timeline);
+    fprintf(stderr, "%zu beats, %.3fs\n", timeline.count, (double)timeline.end / SAMPLE_RATE);
+
+    int failed = 0;
+    if(smf_path && write_smf(m, &timeline, smf_path) != 0) {
+        failed = 1;
+    }
+    if(clock_fd >= 0) {
+        signal(SIGPIPE, SIG_IGN);
+        if(stream_clock(m, &timeline, clock_fd, paced) != 0) {
+            perror("midi clock");
+            failed = 1;
+        }
+    }
+
+    metronome_timeline_free(&timeline);
+    metronome_track_free(m);
+    free(m);
+    return failed;
+}
@@ -0,0 +1,80 @@
+#include "metronome-history.h"
+
+#include <string.h>
+
+static struct TrackVersion **version(struct History *h, const uint32_t index) {
+    return &h->versions[index % HISTORY_DEPTH];
+}
+
+static void release(struct History *h, const uint32_t index) {
+    metronome_track_release(*version(h, index));
+    *version(h, index) = NULL;
+}
+
+int metronome_history_init(struct History *h, struct Metronome *m) {
+    memset(h, 0, sizeof(*h));
+    *version(h, 0) = metronome_track_retain(m);
+    return (*version(h, 0) == NULL) ? -1 : 0;
+}
+
+// Call after anything that may have edited the track. Returns 1 when
+// that published a new version, 0 when nothing changed and -1 on failure.
+int metronome_history_commit(struct History *h, struct Metronome *m) {
+    struct TrackVersion *next = metronome_track_retain(m);
+    if(next == NULL) { return -1; }
+    if(next == *version(h, h->current)) {
+        metronome_track_release(next);
+        return 0;
+    }
+
+    // a new edit after an undo drops what could have been redone
+    while(h->last > h->current) {
+        release(h, h->last--);
+    }
+    h->last = ++h->current;
+    if(h->last - h->first == HISTORY_DEPTH) {
+        release(h, h->first++);
+    }
+    *version(h, h->current) = next;
+    return 1;
+}
+
+// Publishes version to again. Only the measures it does not share with
+// the version published now are copied back into the UI's track.
+static int restore(struct History *h, struct Metronome *m, const uint32_t to) {
+    const uint8_t edited = (to < h->current) ? (*version(h, h->current))->edited : (*version(h, to))->edited;
+    struct TrackVersion *published = metronome_track_restore(m, *version(h, to));
+    if(published == NULL) { return 0; }
+
+    // kept as published, it may be a copy that no longer waits for a bar
+    metronome_track_release(*version(h, to));
+    *version(h, to) = published;
+    h->current = to;
+
+    // back to the measure that was edited, unless that would move playback
+    struct Track *t = &m->track;
+    if(m->state == METRONOME_STOPPED) {
+        t->active_measure = edited;
+    }
+    if(t->active_measure > t->measure_count) {
+        t->active_measure = t->measure_count;
+    }
+    return 1;
+}
+
+// Edits not committed yet are committed first, so they are what is undone.
+int metronome_history_undo(struct History *h, struct Metronome *m) {
+    if(metronome_history_commit(h, m) < 0 || h->current == h->first) { return 0; }
+    return restore(h, m, h->current-1);
+}
+int metronome_history_redo(struct History *h, struct Metronome *m) {
+    if(metronome_history_commit(h, m) != 0 || h->current == h->last) { return 0; }
+    return restore(h, m, h->current+1);
+}
+
+void metronome_history_free(struct History *h) {
+    for(uint32_t i=h->first; i<=h->last; ++i) {
+        release(h, i);
+    }
+    h->first = h->current = h->last = 0;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "metronome.h"
+
+#define HISTORY_DEPTH   128     // versions kept, the oldest is dropped past this
+
+// Undo history of the track, as references to the versions the edits
+// published. Versions share every measure an edit did not touch, so
+// memory grows with the edits rather than the track and a commit is a
+// reference taken. Undo and redo publish a version kept here again,
+// which the callback takes up with one pointer swap.
+struct History {
+    struct TrackVersion *versions[HISTORY_DEPTH];  // ring, indexed modulo
+    uint32_t first;     // oldest version kept
+    uint32_t current;   // the one published
+    uint32_t last;      // newest, past current after an undo
+};
+
+extern int metronome_history_init(struct History *h, struct Metronome *m);
+extern int metronome_history_commit(struct History *h, struct Metronome *m);
+extern int metronome_history_undo(struct History *h, struct Metronome *m);
+extern int metronome_history_redo(struct History *h, struct Metronome *m);
+extern void metronome_history_free(struct History *h);
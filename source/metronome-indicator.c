@@ -0,0 +1,137 @@
+#include "metronome-indicator.h"
+
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+static int64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void metronome_indicator_init(struct Indicator *in, const struct Metronome *m, const uint32_t fps) {
+    memset(in, 0, sizeof(*in));
+    in->tail = __atomic_load_n(&m->beat_head, __ATOMIC_ACQUIRE);
+    in->frame_ns = 1000000000 / (fps ? fps : INDICATOR_FPS);
+}
+
+// Callback start times jitter with scheduling, the frames they render do
+// not. Each new reading only pulls the line a little, unless it is so far
+// off that the engine was reset or the device restarted.
+static void follow_clock(struct Indicator *in, const struct Metronome *m) {
+    const uint32_t sequence = __atomic_load_n(&m->clock_sequence, __ATOMIC_ACQUIRE);
+    if(sequence == in->sequence || (sequence & 1)) { return; }
+
+    const int64_t ns = m->clock_ns;
+    const uint64_t frame = m->clock_frame;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&m->clock_sequence, __ATOMIC_RELAXED) != sequence) { return; }
+    in->sequence = sequence;
+
+    const double predicted = in->anchor_frame + (ns - in->anchor_ns) * 1e-9 * SAMPLE_RATE;
+    const double error = frame - predicted;
+    in->anchor_ns = ns;
+    if(!in->anchored || fabs(error) > INDICATOR_RESYNC) {
+        in->anchor_frame = frame;
+        in->anchored = 0x1;
+    } else {
+        in->anchor_frame = predicted + error * INDICATOR_SMOOTHING;
+    }
+}
+
+static void take_beats(struct Indicator *in, const struct Metronome *m) {
+    struct BeatEvent events[BEAT_EVENTS];
+    const uint32_t tail = in->tail;
+    in->tail = metronome_read_beats(m, tail, events, BEAT_EVENTS);
+    const uint32_t count = in->tail - tail;
+
+    for(uint32_t i=0; i<count && i<BEAT_EVENTS; ++i) {
+        // frames start over from 0 when the engine is reset
+        const uint64_t last = in->pending_count ? in->pending[in->pending_count-1].frame : in->current.frame;
+        if(events[i].frame < last) {
+            in->pending_count = 0;
+            in->playing = 0x0;
+        }
+        if(in->pending_count == INDICATOR_PENDING) {
+            memmove(&in->pending[0], &in->pending[1], (INDICATOR_PENDING-1) * sizeof(struct BeatEvent));
+            in->pending_count--;
+        }
+        in->pending[in->pending_count++] = events[i];
+    }
+}
+
+static double beat_frames(const struct Metronome *m, const struct BeatEvent *beat) {
+    const uint8_t unit = beat->count_in ? m->count_in.unit : m->track.measures[beat->measure].unit;
+    return 60.0 * (4.0 / (unit ? unit : 4)) * SAMPLE_RATE / BPM_FLOAT(beat->bpm ? beat->bpm : BPM(120));
+}
+
+static int64_t audible_ns(const struct Indicator *in, const int64_t latency_ns, const double frame) {
+    return in->anchor_ns + (int64_t)((frame - in->anchor_frame) * 1e9 / SAMPLE_RATE) + latency_ns;
+}
+
+// Call as often as the loop likes, it only does work once a frame or
+// when a beat is due. INDICATOR_BEAT when the audible beat changed,
+// INDICATOR_FRAME when only the progress through it moved.
+enum IndicatorChange metronome_indicator_update(struct Indicator *in, const struct Metronome *m) {
+    const int64_t now = now_ns();
+    if(now < in->next_frame_ns && now < in->due_ns) { return INDICATOR_NONE; }
+    if(now >= in->next_frame_ns) {
+        in->next_frame_ns = (now - in->next_frame_ns < in->frame_ns) ? in->next_frame_ns + in->frame_ns : now + in->frame_ns;
+    }
+    in->due_ns = INT64_MAX;
+
+    if(m->state == METRONOME_STOPPED) {
+        in->tail = __atomic_load_n(&m->beat_head, __ATOMIC_ACQUIRE);
+        in->pending_count = 0;
+        in->anchored = 0x0;
+        in->running = 0x0;
+        if(in->playing) {
+            in->playing = 0x0;
+            return INDICATOR_BEAT;
+        }
+        return INDICATOR_NONE;
+    }
+
+    in->running = 0x1;
+    follow_clock(in, m);
+    take_beats(in, m);
+    if(!in->anchored) { return INDICATOR_NONE; }
+
+    const int64_t latency_ns = __atomic_load_n(&m->latency_ns, __ATOMIC_ACQUIRE);
+    const double audible = in->anchor_frame + (now - in->anchor_ns - latency_ns) * 1e-9 * SAMPLE_RATE;
+
+    enum IndicatorChange change = INDICATOR_FRAME;
+    uint8_t heard = 0;
+    while(heard < in->pending_count && in->pending[heard].frame <= audible) {
+        heard++;
+    }
+    if(heard > 0) {
+        in->current = in->pending[heard-1];
+        in->pending_count -= heard;
+        memmove(&in->pending[0], &in->pending[heard], in->pending_count * sizeof(struct BeatEvent));
+        in->playing = 0x1;
+        change = INDICATOR_BEAT;
+    }
+    if(!in->playing) {
+        if(in->pending_count) { in->due_ns = audible_ns(in, latency_ns, in->pending[0].frame); }
+        return INDICATOR_NONE;
+    }
+
+    // the next beat may not be rendered yet, its predicted frame still
+    // wakes us in time to find it in the ring
+    const double length = in->pending_count ? (double)(in->pending[0].frame - in->current.frame) : beat_frames(m, &in->current);
+    const double progress = (audible - in->current.frame) / length;
+    in->progress = (progress < 0.0) ? 0.f : (progress > 1.0) ? 1.f : progress;
+    in->due_ns = audible_ns(in, latency_ns, in->current.frame + length);
+    return change;
+}
+
+// For the UI's input timeout: until the next frame or beat while playing.
+int metronome_indicator_timeout(const struct Indicator *in) {
+    if(!in->running) { return INDICATOR_IDLE_MS; }
+
+    const int64_t due_ns = (in->due_ns < in->next_frame_ns) ? in->due_ns : in->next_frame_ns;
+    const int64_t wait_ns = due_ns - now_ns();
+    return (wait_ns > 0) ? (int)((wait_ns + 999999) / 1000000) : 0;
+}
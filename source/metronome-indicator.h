@@ -0,0 +1,43 @@
+#pragma once
+
+#include "metronome.h"
+
+#define INDICATOR_FPS       60
+#define INDICATOR_PENDING   16
+#define INDICATOR_RESYNC    (SAMPLE_RATE/20)    // further off the prediction is a restart or an xrun
+#define INDICATOR_SMOOTHING 0.1
+#define INDICATOR_IDLE_MS   100                 // how often a stopped indicator looks again
+
+enum IndicatorChange { INDICATOR_NONE, INDICATOR_FRAME, INDICATOR_BEAT };
+
+// Follows the beat that is being heard rather than the one being
+// rendered. The callback's frame clock is smoothed into a steady line,
+// pushed back by the device latency, and beats from the beat ring are
+// held until that line reaches them. Progress updates are paced to a
+// fixed frame rate, beats are picked up at the time they are due.
+struct Indicator {
+    // smoothed callback clock
+    uint32_t sequence;
+    int64_t anchor_ns;
+    double anchor_frame;
+    uint8_t anchored;
+
+    // rendered, not heard yet
+    uint32_t tail;
+    struct BeatEvent pending[INDICATOR_PENDING];
+    uint8_t pending_count;
+
+    // heard now
+    struct BeatEvent current;
+    uint8_t playing;
+    float progress;     // through the current beat, 0 to 1
+    uint8_t running;    // the session was not stopped at the last update
+
+    int64_t frame_ns;
+    int64_t next_frame_ns;
+    int64_t due_ns;     // the next beat is heard, woken for outside the frame rate
+};
+
+extern void metronome_indicator_init(struct Indicator *in, const struct Metronome *m, uint32_t fps);
+extern enum IndicatorChange metronome_indicator_update(struct Indicator *in, const struct Metronome *m);
+extern int metronome_indicator_timeout(const struct Indicator *in);
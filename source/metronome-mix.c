@@ -0,0 +1,108 @@
+#include "metronome-mix.h"
+
+#include <string.h>
+
+// four lanes, loaded and stored through memcpy so the interleaved output
+// needs no particular alignment
+typedef float v4f __attribute__((vector_size(16)));
+
+const char *metronome_voice_names[VOICE_COUNT] = {
+    [VOICE_DOWNBEAT] = "downbeat",
+    [VOICE_ACCENT]   = "accent",
+    [VOICE_BEAT]     = "beat",
+    [VOICE_GHOST]    = "ghost",
+    [VOICE_COUNT_IN] = "count_in",
+};
+
+// Every voice on both channels of the pair, the way sessions always played.
+void metronome_routing_default(struct Routing *r) {
+    memset(r, 0, sizeof(*r));
+    r->channels = 2;
+    for(uint8_t v=0; v<VOICE_COUNT; ++v) {
+        r->gains[v][0] = 1.f;
+        r->gains[v][1] = 1.f;
+    }
+    metronome_routing_compile(r);
+}
+
+void metronome_routing_compile(struct Routing *r) {
+    if(r->channels < 1) { r->channels = 1; }
+    if(r->channels > MAX_ROUTE_CHANNELS) { r->channels = MAX_ROUTE_CHANNELS; }
+
+    for(uint8_t v=0; v<VOICE_COUNT; ++v) {
+        const float first = r->gains[v][0];
+        uint8_t same = 0x1;
+        uint8_t routed = 0x0;
+        for(uint8_t c=0; c<r->channels; ++c) {
+            same   &= (r->gains[v][c] == first);
+            routed |= (r->gains[v][c] != 0.f);
+        }
+        r->fanout[v] = same ? first : 0.f;
+        r->routed[v] = routed;
+    }
+}
+
+// The same signal on every output, scaled once per frame.
+static void mix_fanout(float *out, const uint32_t stride, const uint8_t outputs, const float *mono, const uint32_t frames, const float gain) {
+    uint32_t k = 0;
+    if(outputs == 2 && stride == 2) {
+        // a plain stereo buffer is contiguous, two frames to a vector
+        for(; k+2<=frames; k+=2) {
+            const float a = mono[k] * gain, b = mono[k+1] * gain;
+            const v4f s = {a, a, b, b};
+            v4f o;
+            memcpy(&o, &out[k*2], sizeof(o));
+            o += s;
+            memcpy(&out[k*2], &o, sizeof(o));
+        }
+    }
+    for(; k<frames; ++k) {
+        const float s = mono[k] * gain;
+        const v4f splat = {s, s, s, s};
+        float *frame = &out[k*stride];
+        uint8_t c = 0;
+        for(; c+4<=outputs; c+=4) {
+            v4f o;
+            memcpy(&o, &frame[c], sizeof(o));
+            o += splat;
+            memcpy(&frame[c], &o, sizeof(o));
+        }
+        for(; c<outputs; ++c) {
+            frame[c] += s;
+        }
+    }
+}
+
+// A gain per output, four outputs to a vector multiply-add.
+static void mix_matrix(float *out, const uint32_t stride, const uint8_t outputs, const float *mono, const uint32_t frames, const float *gains) {
+    v4f g[MAX_ROUTE_CHANNELS/4];
+    memcpy(g, gains, sizeof(g));
+
+    for(uint32_t k=0; k<frames; ++k) {
+        const v4f splat = {mono[k], mono[k], mono[k], mono[k]};
+        float *frame = &out[k*stride];
+        uint8_t c = 0;
+        for(; c+4<=outputs; c+=4) {
+            v4f o;
+            memcpy(&o, &frame[c], sizeof(o));
+            o += splat * g[c/4];
+            memcpy(&frame[c], &o, sizeof(o));
+        }
+        for(; c<outputs; ++c) {
+            frame[c] += mono[k] * gains[c];
+        }
+    }
+}
+
+// Adds a block of one voice into outputs channels of an interleaved
+// buffer with stride channels to a frame. Called from the audio callback.
+void metronome_mix(const struct Routing *r, const uint8_t voice, float *out, const uint32_t stride, uint8_t outputs, const float *mono, const uint32_t frames) {
+    if(voice >= VOICE_COUNT || !r->routed[voice]) { return; }
+    if(outputs > r->channels) { outputs = r->channels; }
+
+    if(r->fanout[voice] != 0.f) {
+        mix_fanout(out, stride, outputs, mono, frames, r->fanout[voice]);
+    } else {
+        mix_matrix(out, stride, outputs, mono, frames, r->gains[voice]);
+    }
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "metronome.h"
+
+extern const char *metronome_voice_names[VOICE_COUNT];
+
+extern void metronome_routing_default(struct Routing *r);
+extern void metronome_routing_compile(struct Routing *r);
+extern void metronome_mix(const struct Routing *r, uint8_t voice, float *out, uint32_t stride, uint8_t outputs, const float *mono, uint32_t frames);
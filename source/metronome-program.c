@@ -0,0 +1,57 @@
+#include "metronome-program.h"
+
+// splitmix64, a well mixed value for every input so no state needs to
+// be carried from one bar to the next
+static uint64_t draw(const struct Practice *p, const uint32_t n) {
+    uint64_t x = (((uint64_t)p->seed << 32) | n) + 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+static bpm_t towards(const struct Practice *p, const bpm_t amount) {
+    return (p->bpm_to >= p->bpm_from) ? p->bpm_from + amount : p->bpm_from - amount;
+}
+
+// Works out bar of a program from its settings, its seed and the bar
+// number alone. Nothing is generated ahead of time or kept between bars,
+// so a program of any length runs in constant memory and replays the
+// same from the same seed. Safe to call from the audio callback.
+struct ProgramBar metronome_program_bar(const struct Practice *p, const uint32_t bar) {
+    struct ProgramBar out = {.bpm = p->bpm_from, .silent = 0x0};
+    const uint32_t interval = p->interval ? p->interval : 1;
+    const uint32_t block = bar / interval;
+    const bpm_t span = (p->bpm_to > p->bpm_from) ? p->bpm_to - p->bpm_from : p->bpm_from - p->bpm_to;
+
+    switch(p->program) {
+        case PROGRAM_RANDOM: {
+            // a new tempo every interval bars, on the step grid if there is one
+            const uint64_t choices = p->bpm_step ? span / p->bpm_step + 1 : (uint64_t)span + 1;
+            const uint64_t choice = draw(p, block) % choices;
+            out.bpm = towards(p, p->bpm_step ? choice * p->bpm_step : choice);
+            break;
+        }
+        case PROGRAM_BURSTS: {
+            out.bpm = (block % 2) ? p->bpm_to : p->bpm_from;
+            break;
+        }
+        case PROGRAM_DROPOUT: {
+            // the first bar of every interval is always heard, the others
+            // go silent more and more often until dropout percent of them are
+            const uint32_t climb = p->bars ? p->bars : PROGRAM_DROPOUT_BARS;
+            const uint64_t chance = (uint64_t)p->dropout * (bar < climb ? bar : climb) / climb;
+            out.silent = (bar % interval != 0) && (draw(p, bar) % 100 < chance);
+            break;
+        }
+        case PROGRAM_CYCLE: {
+            // climbs by bpm_step every interval bars and starts over once
+            // it has held bpm_to for one interval
+            const uint32_t steps = p->bpm_step ? (span + p->bpm_step - 1) / p->bpm_step : 1;
+            const uint64_t step = block % (steps + 1);
+            out.bpm = towards(p, (step * p->bpm_step < span) ? step * p->bpm_step : span);
+            break;
+        }
+    }
+    out.bpm = (out.bpm < MIN_BPM) ? MIN_BPM : (out.bpm > MAX_BPM) ? MAX_BPM : out.bpm;
+    return out;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "metronome.h"
+
+#define PROGRAM_DROPOUT_BARS    32  // an endless dropout reaches its full rate after this many bars
+
+// One bar of a generated practice program.
+struct ProgramBar {
+    bpm_t bpm;
+    uint8_t silent;
+};
+
+extern struct ProgramBar metronome_program_bar(const struct Practice *p, uint32_t bar);
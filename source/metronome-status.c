@@ -0,0 +1,101 @@
+#include "metronome-status.h"
+#include "metronome.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// A NULL name keeps the block private to this process, for in-process
+// readers such as the sync peer.
+int metronome_status_open(struct Metronome *m, const char *name) {
+    struct MetronomeStatus *status = MAP_FAILED;
+    if(name == NULL) {
+        status = mmap(NULL, sizeof(struct MetronomeStatus), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    } else {
+        const int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+        if(fd < 0) {
+            perror("status shm_open");
+            return -1;
+        }
+        if(ftruncate(fd, sizeof(struct MetronomeStatus)) == 0) {
+            status = mmap(NULL, sizeof(struct MetronomeStatus), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+    }
+    if(status == MAP_FAILED) {
+        perror("status mmap");
+        return -1;
+    }
+
+    // touched once here so the callback never takes the page fault
+    memset(status, 0, sizeof(*status));
+    status->magic       = METRONOME_STATUS_MAGIC;
+    status->version     = METRONOME_STATUS_VERSION;
+    status->sample_rate = SAMPLE_RATE;
+
+    __atomic_store_n(&m->status, status, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Safe while the session plays, the block is unmapped only once the
+// callback can no longer be publishing into it.
+void metronome_status_close(struct Metronome *m, const char *name) {
+    struct MetronomeStatus *status = __atomic_exchange_n(&m->status, NULL, __ATOMIC_SEQ_CST);
+    if(status == NULL) { return; }
+
+    metronome_wait_render(m);
+    munmap(status, sizeof(struct MetronomeStatus));
+    if(name) { shm_unlink(name); }
+}
+
+void metronome_status_publish(struct Metronome *m) {
+    struct MetronomeStatus *status = __atomic_load_n(&m->status, __ATOMIC_ACQUIRE);
+    const struct TrackVersion *t = m->playing;
+    if(status == NULL || t == NULL) { return; }
+    const struct Engine *e = &m->engine;
+    // the UI moves it as well, read once
+    const uint8_t moved = __atomic_load_n(&m->track.active_measure, __ATOMIC_RELAXED);
+    const uint8_t active = (moved > t->measure_count) ? t->measure_count : moved;
+    const struct Measure *measure = (m->state==METRONOME_STARTED) ? &m->count_in : &t->measures[active]->measure;
+
+    // clock_gettime on CLOCK_MONOTONIC is served from the vDSO, no syscall
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const int64_t now_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    const double remaining = (e->beat_samples > e->beat_sample_counter) ? e->beat_samples - e->beat_sample_counter : 0.0;
+
+    const uint32_t sequence = status->sequence;
+    __atomic_store_n(&status->sequence, sequence+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    status->bpm             = __atomic_load_n(&m->bpm, __ATOMIC_RELAXED);
+    status->state           = m->state;
+    status->measure         = active+1;
+    status->beat            = e->beat_counter+1;
+    status->beats           = measure->beats;
+    status->unit            = measure->unit;
+    status->frame           = e->frames;
+    status->next_beat_frame = e->frames + (uint64_t)remaining;
+    status->updated_ns      = now_ns;
+    status->next_beat_ns    = now_ns + (int64_t)(remaining * 1e9 / SAMPLE_RATE);
+    status->downbeat_frame  = e->bar_frame;
+    status->downbeat_ns     = now_ns - (int64_t)((e->frames - e->bar_frame) * 1e9 / SAMPLE_RATE);
+
+    __atomic_store_n(&status->sequence, sequence+2, __ATOMIC_RELEASE);
+}
+
+const struct MetronomeStatus *metronome_status_map(const char *name) {
+    const int fd = shm_open(name, O_RDONLY, 0);
+    if(fd < 0) { return NULL; }
+
+    const struct MetronomeStatus *status = mmap(NULL, sizeof(struct MetronomeStatus), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return (status == MAP_FAILED) ? NULL : status;
+}
+
+void metronome_status_unmap(const struct MetronomeStatus *status) {
+    munmap((void*)status, sizeof(struct MetronomeStatus));
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+
+struct Metronome;
+
+#define METRONOME_STATUS_NAME       "/metronome"
+#define METRONOME_STATUS_MAGIC      0x4d4e5453  // "MNTS"
+#define METRONOME_STATUS_VERSION    2
+
+// Published by the audio callback once per block into a shared memory
+// segment. sequence is odd while a block is being written, readers copy
+// the whole struct and retry until they see the same even sequence on
+// both sides of the copy, see metronome_status_snapshot().
+struct MetronomeStatus {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sequence;
+    uint32_t sample_rate;
+
+    uint32_t bpm;               // bpm_t, 1/100 BPM
+    uint8_t state;              // enum MetronomeState
+    uint8_t measure;            // 1-based
+    uint8_t beat;               // 1-based
+    uint8_t beats;
+    uint8_t unit;
+
+    uint64_t frame;             // frames rendered when the block was published
+    uint64_t next_beat_frame;
+    int64_t  updated_ns;        // CLOCK_MONOTONIC when the block was published
+    int64_t  next_beat_ns;      // updated_ns plus the frames left to the next beat, output latency not included
+    uint64_t downbeat_frame;    // the current bar's downbeat
+    int64_t  downbeat_ns;
+} __attribute__((aligned(64)));
+
+extern int metronome_status_open(struct Metronome *m, const char *name);
+extern void metronome_status_close(struct Metronome *m, const char *name);
+extern void metronome_status_publish(struct Metronome *m);
+
+// for readers, maps an existing segment read only, NULL if there is none
+extern const struct MetronomeStatus *metronome_status_map(const char *name);
+extern void metronome_status_unmap(const struct MetronomeStatus *status);
+
+// Copies a consistent snapshot without any syscalls. Returns 0 if the
+// segment is not a status block this reader understands, or if the writer
+// died halfway through a block and left sequence odd.
+static inline int metronome_status_snapshot(const struct MetronomeStatus *status, struct MetronomeStatus *out) {
+    for(int tries=0; tries<1000; ++tries) {
+        const uint32_t before = __atomic_load_n(&status->sequence, __ATOMIC_ACQUIRE);
+        if(before & 1) { continue; }
+
+        __builtin_memcpy(out, (const void*)status, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&status->sequence, __ATOMIC_RELAXED) == before) {
+            return out->magic == METRONOME_STATUS_MAGIC && out->version == METRONOME_STATUS_VERSION;
+        }
+    }
+    return 0;
+}
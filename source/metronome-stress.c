@@ -0,0 +1,250 @@
+#include "metronome.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHANNELS        (2)
+#define MAX_EDITORS     (16)
+#define BUCKET_NS       (100)       // render time histogram resolution
+#define BUCKETS         (10000)     // up to a millisecond, slower lands in the last
+
+enum Edit {
+    EDIT_BEATS, EDIT_UNIT, EDIT_ACCENT, EDIT_GROUPING, EDIT_INSERT, EDIT_REMOVE,
+    EDIT_BPM, EDIT_QUEUE, EDIT_SEEK, EDIT_LOOP, EDIT_COUNT
+};
+static const char *edit_names[EDIT_COUNT] = {
+    "beats", "unit", "accent", "grouping", "insert", "remove", "bpm", "queue", "seek", "loop"
+};
+
+struct Stress {
+    struct Metronome *m;
+    pthread_mutex_t edit_lock;  // editors take turns, as the ui and control threads should
+    uint8_t locked;
+    uint8_t paced;
+    uint8_t running;
+};
+
+struct Editor {
+    pthread_t thread;
+    struct Stress *s;
+    unsigned int seed;
+    uint64_t edits[EDIT_COUNT];
+} CACHE_ALIGNED;
+
+struct Renderer {
+    pthread_t thread;
+    struct Stress *s;
+    uint64_t periods;
+    uint64_t overruns;      // took longer than the period it rendered
+    int64_t max_ns;
+    uint32_t histogram[BUCKETS];
+    float out[PERIOD_FRAMES*CHANNELS];
+};
+
+struct Reader {
+    pthread_t thread;
+    struct Stress *s;
+    uint64_t beats;
+    uint64_t overruns;      // fell more than the ring behind
+};
+
+static int64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void edit(struct Metronome *m, const enum Edit e, unsigned int *seed) {
+    const int r = rand_r(seed);
+    switch(e) {
+        case EDIT_BEATS:    (r & 1) ? metronome_inc_beats(m) : metronome_dec_beats(m); break;
+        case EDIT_UNIT:     (r & 1) ? metronome_inc_unit(m) : metronome_dec_unit(m); break;
+        case EDIT_ACCENT:   metronome_set_accent(m, r % MAX_BEATS_PER_MEASURE, r % ACCENT_COUNT); break;
+        case EDIT_GROUPING: metronome_set_grouping(m, (r & 1) ? "3+3+2" : "2+2+3"); break;
+        case EDIT_INSERT: {
+            // refused once the track is full, which removes keep it from staying
+            switch(r % 4) {
+                case 0: metronome_insert_measure_at_start(m); break;
+                case 1: metronome_insert_measure_before(m); break;
+                case 2: metronome_insert_measure_after(m); break;
+                case 3: metronome_insert_measure_at_end(m); break;
+            }
+            break;
+        }
+        case EDIT_REMOVE:   metronome_remove_measure(m); break;
+        case EDIT_BPM:      metronome_set_bpm(m, 40 + r % 400); break;
+        case EDIT_QUEUE:    metronome_queue_change(m, BPM(40 + r % 400), 0, 0, r % 3); break;
+        case EDIT_SEEK:     metronome_seek(m, r % (m->track.measure_count+1), 0); break;
+        case EDIT_LOOP: {
+            if(r & 1) {
+                metronome_set_loop(m, 0, r % (m->track.measure_count+1));
+            } else {
+                metronome_clear_loop(m);
+            }
+            break;
+        }
+        case EDIT_COUNT: break;
+    }
+}
+
+static void *editor_main(void *arg) {
+    struct Editor *e = arg;
+    struct Stress *s = e->s;
+    while(__atomic_load_n(&s->running, __ATOMIC_ACQUIRE)) {
+        const enum Edit kind = rand_r(&e->seed) % EDIT_COUNT;
+        // inserts and removes reshape the track, racing them would test a
+        // measure count torn between two editors rather than the callback
+        const uint8_t locked = s->locked || kind == EDIT_INSERT || kind == EDIT_REMOVE;
+        if(locked) { pthread_mutex_lock(&s->edit_lock); }
+        edit(s->m, kind, &e->seed);
+        if(locked) { pthread_mutex_unlock(&s->edit_lock); }
+        e->edits[kind]++;
+    }
+    return NULL;
+}
+
+// Stands in for the device: one period at a time into a buffer nobody
+// plays, on the period's schedule unless running flat out.
+static void *renderer_main(void *arg) {
+    struct Renderer *r = arg;
+    struct Stress *s = r->s;
+    const int64_t period_ns = (int64_t)PERIOD_FRAMES * 1000000000 / SAMPLE_RATE;
+    int64_t next_ns = now_ns();
+
+    while(__atomic_load_n(&s->running, __ATOMIC_ACQUIRE)) {
+        const int64_t begin_ns = now_ns();
+        memset(r->out, 0, sizeof(r->out));
+        // counted the way the device callback does, edits wait on it
+        __atomic_add_fetch(&s->m->rendering, 1, __ATOMIC_SEQ_CST);
+        metronome_render(s->m, r->out, PERIOD_FRAMES, CHANNELS);
+        __atomic_add_fetch(&s->m->rendering, 1, __ATOMIC_RELEASE);
+        const int64_t took_ns = now_ns() - begin_ns;
+
+        r->histogram[(took_ns/BUCKET_NS < BUCKETS) ? took_ns/BUCKET_NS : BUCKETS-1]++;
+        if(took_ns > r->max_ns) { r->max_ns = took_ns; }
+        if(took_ns > period_ns) { r->overruns++; }
+        r->periods++;
+
+        if(s->paced) {
+            next_ns += period_ns;
+            const struct timespec at = {.tv_sec = next_ns / 1000000000, .tv_nsec = next_ns % 1000000000};
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL);
+        }
+    }
+    return NULL;
+}
+
+// Follows the beat ring the way the ui does.
+static void *reader_main(void *arg) {
+    struct Reader *r = arg;
+    struct Metronome *m = r->s->m;
+    struct BeatEvent events[BEAT_EVENTS];
+    uint32_t tail = __atomic_load_n(&m->beat_head, __ATOMIC_ACQUIRE);
+
+    while(__atomic_load_n(&r->s->running, __ATOMIC_ACQUIRE)) {
+        const uint32_t head = metronome_read_beats(m, tail, events, BEAT_EVENTS);
+        if(head - tail > BEAT_EVENTS) { r->overruns++; }
+        r->beats += head - tail;
+        tail = head;
+        usleep(1000);
+    }
+    return NULL;
+}
+
+static double percentile(const struct Renderer *r, const double p) {
+    const uint64_t rank = (uint64_t)(p * (r->periods-1));
+    uint64_t seen = 0;
+    for(uint32_t i=0; i<BUCKETS; ++i) {
+        seen += r->histogram[i];
+        if(seen > rank) { return (i+1) * BUCKET_NS / 1000.0; }
+    }
+    return r->max_ns / 1000.0;
+}
+
+static void usage(const char *name) {
+    printf("usage: %s [-e editors] [-s seconds] [-f] [-u]\n", name);
+    printf("  -f  render flat out instead of once a period\n");
+    printf("  -u  let the editors race each other too, but for inserts and removes;\n");
+    printf("      the track is the UI's alone, a race detector flags these races\n");
+}
+
+int main(int argc, char **argv) {
+    int editor_count = 3;
+    double seconds = 5.0;
+    struct Stress s = {.locked = 0x1, .paced = 0x1, .running = 0x1};
+
+    int opt;
+    while((opt = getopt(argc, argv, "e:s:fuh")) != -1) {
+        switch(opt) {
+            case 'e': editor_count = atoi(optarg); break;
+            case 's': seconds = atof(optarg); break;
+            case 'f': s.paced = 0x0; break;
+            case 'u': s.locked = 0x0; break;
+            default:  usage(argv[0]); return 1;
+        }
+    }
+    if(editor_count < 1) { editor_count = 1; }
+    if(editor_count > MAX_EDITORS) { editor_count = MAX_EDITORS; }
+
+    s.m = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct Metronome));
+    metronome_init(s.m);
+    s.m->hosted = 0x1;
+    pthread_mutex_init(&s.edit_lock, NULL);
+    metronome_start(s.m);
+
+    struct Editor *editors = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct Editor) * editor_count);
+    struct Renderer *renderer = calloc(1, sizeof(struct Renderer));
+    struct Reader reader = {.s = &s};
+    renderer->s = &s;
+
+    const int64_t start_ns = now_ns();
+    pthread_create(&renderer->thread, NULL, renderer_main, renderer);
+    pthread_create(&reader.thread, NULL, reader_main, &reader);
+    for(int i=0; i<editor_count; ++i) {
+        memset(&editors[i], 0, sizeof(editors[i]));
+        editors[i].s = &s;
+        editors[i].seed = i+1;
+        pthread_create(&editors[i].thread, NULL, editor_main, &editors[i]);
+    }
+
+    usleep(seconds * 1000000);
+    __atomic_store_n(&s.running, 0x0, __ATOMIC_RELEASE);
+
+    uint64_t edits[EDIT_COUNT] = {0};
+    uint64_t total = 0;
+    for(int i=0; i<editor_count; ++i) {
+        pthread_join(editors[i].thread, NULL);
+        for(int e=0; e<EDIT_COUNT; ++e) {
+            edits[e] += editors[i].edits[e];
+            total    += editors[i].edits[e];
+        }
+    }
+    pthread_join(renderer->thread, NULL);
+    pthread_join(reader.thread, NULL);
+    const double elapsed = (now_ns() - start_ns) / 1e9;
+
+    printf("%d editors%s, %s rendering, %.2fs\n", editor_count, s.locked ? " taking turns" : " racing", s.paced ? "paced" : "flat out", elapsed);
+    printf("edits: %llu, %.0f/s\n", (unsigned long long)total, total / elapsed);
+    for(int e=0; e<EDIT_COUNT; ++e) {
+        printf("  %-9s %10llu\n", edit_names[e], (unsigned long long)edits[e]);
+    }
+    printf("render: %llu periods of %d frames, %llu over their %.0f us\n",
+        (unsigned long long)renderer->periods, PERIOD_FRAMES, (unsigned long long)renderer->overruns,
+        PERIOD_FRAMES * 1e6 / SAMPLE_RATE
+    );
+    printf("  p50 %.1f us  p99 %.1f us  p99.9 %.1f us  max %.1f us\n",
+        percentile(renderer, 0.5), percentile(renderer, 0.99), percentile(renderer, 0.999), renderer->max_ns / 1000.0
+    );
+    printf("beats: %llu read, %llu overruns\n", (unsigned long long)reader.beats, (unsigned long long)reader.overruns);
+
+    pthread_mutex_destroy(&s.edit_lock);
+    metronome_track_free(s.m);
+    free(renderer);
+    free(editors);
+    free(s.m);
+    return 0;
+}
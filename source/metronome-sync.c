@@ -0,0 +1,384 @@
+#include "metronome-sync.h"
+#include "metronome-status.h"
+#include "metronome.h"
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SYNC_MAGIC          0x4d4e5359  // "MNSY"
+#define SYNC_VERSION        1
+#define SYNC_INTERVAL_NS    (100*1000000LL)
+#define SYNC_TIMEOUT_NS     (1000*1000000LL)
+#define SYNC_MIN_SAMPLES    4
+
+// phase errors below DEADBAND samples are left alone, larger ones are
+// corrected by at most SLEW samples per beat once joined
+#define SYNC_DEADBAND       (SAMPLE_RATE/5000)
+#define SYNC_SLEW           (SAMPLE_RATE/1000)
+#define SYNC_MAX_TRIM       (1e-3)
+
+struct SyncEcho {
+    uint64_t peer;
+    int64_t origin_ns;
+    int64_t received_ns;
+} __attribute__((packed));
+
+// on the wire every field is big endian
+struct SyncPacket {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t state;
+    uint8_t beats;
+    uint8_t unit;
+    uint8_t echo_count;
+    uint32_t bpm;
+    uint32_t uptime_ms;
+    uint64_t id;
+    int64_t origin_ns;
+    int64_t downbeat_ns;
+    struct SyncEcho echoes[MAX_SYNC_PEERS];
+} __attribute__((packed));
+
+static int64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static double beat_ns(const uint32_t bpm, const uint8_t unit) {
+    return 60e9 * (4.0/unit) / BPM_FLOAT(bpm);
+}
+
+// Clock time of the downbeat of the bar playing when the block was
+// published, 0 unless the track proper is running.
+static int64_t status_downbeat(const struct MetronomeStatus *status) {
+    return (status->state == METRONOME_RUNNING) ? status->downbeat_ns : 0;
+}
+
+static void add_sample(struct SyncPeer *p, const int64_t local, const int64_t offset, const int64_t delay) {
+    p->samples[p->sample_count % SYNC_SAMPLES] = (struct SyncSample){local, offset, delay};
+    p->sample_count++;
+
+    const uint32_t count = p->sample_count < SYNC_SAMPLES ? p->sample_count : SYNC_SAMPLES;
+
+    // the least delayed sample is the least skewed by queueing, drift is
+    // the least squares slope of the offsets over the window
+    const struct SyncSample *best = &p->samples[0];
+    double mean_t = 0.0, mean_o = 0.0;
+    for(uint32_t i=0; i<count; ++i) {
+        if(p->samples[i].delay_ns < best->delay_ns) { best = &p->samples[i]; }
+        mean_t += (double)(p->samples[i].local_ns - local) / count;
+        mean_o += (double)(p->samples[i].offset_ns - offset) / count;
+    }
+    double num = 0.0, den = 0.0;
+    for(uint32_t i=0; i<count; ++i) {
+        const double dt = (double)(p->samples[i].local_ns - local) - mean_t;
+        num += dt * ((double)(p->samples[i].offset_ns - offset) - mean_o);
+        den += dt * dt;
+    }
+    const double drift = (den > 0.0) ? num/den : 0.0;
+
+    p->drift_ppm = drift * 1e6;
+    p->offset_ns = best->offset_ns + (int64_t)(drift * (local - best->local_ns));
+}
+
+static struct SyncPeer *find_peer(struct SyncServer *s, const uint64_t id) {
+    for(uint8_t i=0; i<s->peer_count; ++i) {
+        if(s->peers[i].id == id) { return &s->peers[i]; }
+    }
+    if(s->peer_count >= MAX_SYNC_PEERS) { return NULL; }
+
+    struct SyncPeer *p = &s->peers[s->peer_count++];
+    memset(p, 0, sizeof(*p));
+    p->id = id;
+    return p;
+}
+
+static void send_packet(struct SyncServer *s, const int64_t now) {
+    struct MetronomeStatus status;
+    const int valid = metronome_status_snapshot(s->m->status, &status);
+
+    struct SyncPacket packet = {
+        .magic       = htobe32(SYNC_MAGIC),
+        .version     = htobe16(SYNC_VERSION),
+        .state       = valid ? status.state : METRONOME_STOPPED,
+        .beats       = valid ? status.beats : 0,
+        .unit        = valid ? status.unit : 0,
+        .echo_count  = s->peer_count,
+        .bpm         = htobe32(valid ? status.bpm : 0),
+        .uptime_ms   = htobe32((now - s->started_ns) / 1000000),
+        .id          = htobe64(s->id),
+        .origin_ns   = htobe64(now),
+        .downbeat_ns = htobe64(valid ? status_downbeat(&status) : 0),
+    };
+    for(uint8_t i=0; i<s->peer_count; ++i) {
+        packet.echoes[i].peer        = htobe64(s->peers[i].id);
+        packet.echoes[i].origin_ns   = htobe64(s->peers[i].origin_ns);
+        packet.echoes[i].received_ns = htobe64(s->peers[i].received_ns);
+    }
+
+    struct sockaddr_in group = {.sin_family = AF_INET, .sin_port = htons(s->port)};
+    inet_pton(AF_INET, SYNC_GROUP, &group.sin_addr);
+    const size_t size = sizeof(packet) - sizeof(packet.echoes) + s->peer_count * sizeof(struct SyncEcho);
+    sendto(s->fd, &packet, size, 0, (struct sockaddr*)&group, sizeof(group));
+    s->sent_ns = now;
+}
+
+// Reads one packet, 0 once there are none left. from is the peer it came
+// from, NULL for our own looped back packets and garbage.
+static int receive_packet(struct SyncServer *s, struct SyncPeer **from) {
+    struct SyncPacket packet;
+    const ssize_t size = recv(s->fd, &packet, sizeof(packet), MSG_DONTWAIT);
+    const int64_t received = now_ns();
+    *from = NULL;
+    if(size < 0) { return 0; }
+
+    const size_t header = sizeof(packet) - sizeof(packet.echoes);
+    if(size < (ssize_t)header || be32toh(packet.magic) != SYNC_MAGIC || be16toh(packet.version) != SYNC_VERSION) { return 1; }
+    if(packet.echo_count > MAX_SYNC_PEERS || (size_t)size < header + packet.echo_count * sizeof(struct SyncEcho)) { return 1; }
+
+    const uint64_t id = be64toh(packet.id);
+    if(id == s->id) { return 1; }
+
+    struct SyncPeer *p = find_peer(s, id);
+    if(p == NULL) { return 1; }
+
+    p->uptime_ms    = be32toh(packet.uptime_ms);
+    p->last_seen_ns = received;
+    p->origin_ns    = be64toh(packet.origin_ns);
+    p->received_ns  = received;
+    p->bpm          = be32toh(packet.bpm);
+    p->state        = packet.state;
+    p->beats        = packet.beats;
+    p->unit         = packet.unit;
+    p->downbeat_ns  = be64toh(packet.downbeat_ns);
+
+    for(uint8_t i=0; i<packet.echo_count; ++i) {
+        if(be64toh(packet.echoes[i].peer) != s->id) { continue; }
+
+        const int64_t t1 = be64toh(packet.echoes[i].origin_ns);
+        const int64_t t2 = be64toh(packet.echoes[i].received_ns);
+        const int64_t t3 = p->origin_ns;
+        const int64_t t4 = received;
+        if(t1 == 0 || t2 == 0) { break; }
+        add_sample(p, t4, ((t2 - t1) + (t3 - t4)) / 2, (t4 - t1) - (t3 - t2));
+        break;
+    }
+    *from = p;
+    return 1;
+}
+
+static void expire_peers(struct SyncServer *s, const int64_t now) {
+    for(uint8_t i=0; i<s->peer_count;) {
+        if(now - s->peers[i].last_seen_ns > SYNC_TIMEOUT_NS) {
+            s->peers[i] = s->peers[--s->peer_count];
+        } else {
+            ++i;
+        }
+    }
+}
+
+// The longest running peer leads, NULL if that is us.
+static struct SyncPeer *elect_leader(struct SyncServer *s, const int64_t now) {
+    struct SyncPeer *leader = NULL;
+    int64_t uptime = now - s->started_ns;
+    uint64_t id = s->id;
+    for(uint8_t i=0; i<s->peer_count; ++i) {
+        struct SyncPeer *p = &s->peers[i];
+        const int64_t peer_uptime = (int64_t)p->uptime_ms * 1000000 + (now - p->last_seen_ns);
+        if(peer_uptime > uptime || (peer_uptime == uptime && p->id < id)) {
+            leader = p;
+            uptime = peer_uptime;
+            id = p->id;
+        }
+    }
+    return leader;
+}
+
+// The rate trim is read by the callback on every beat.
+static double load_ratio(const struct Metronome *m) {
+    double ratio;
+    __atomic_load(&m->sync.ratio, &ratio, __ATOMIC_RELAXED);
+    return ratio;
+}
+static void store_ratio(struct Metronome *m, double ratio) {
+    __atomic_store(&m->sync.ratio, &ratio, __ATOMIC_RELAXED);
+}
+
+// Returns 0 while the callback has yet to take the adjust posted before,
+// which is left alone and this one not posted.
+static int post_adjust(struct SyncServer *s, const double adjust, const uint8_t beats, const uint8_t bar) {
+    struct Sync *sync = &s->m->sync;
+    if(__atomic_load_n(&sync->pending, __ATOMIC_ACQUIRE)) { return 0; }
+    s->settled_frame = __atomic_load_n(&sync->settled_frame, __ATOMIC_ACQUIRE);
+    sync->adjust = adjust;
+    sync->beats  = beats;
+    sync->bar    = bar;
+    __atomic_store_n(&sync->pending, 0x1, __ATOMIC_RELEASE);
+    s->posted = 0x1;
+    return 1;
+}
+
+// Runs once per packet from the leader. Tempo and meter are taken over at
+// the next bar line, then the whole phase error is spread over the beats
+// of one bar so a joining player never jumps. After that only small
+// slewed corrections are made, and a rate trim absorbs steady drift.
+static void follow(struct SyncServer *s, const struct SyncPeer *leader) {
+    struct Metronome *m = s->m;
+    struct MetronomeStatus status;
+    if(!metronome_status_snapshot(m->status, &status)) { return; }
+    if(leader->state != METRONOME_RUNNING || status.state != METRONOME_RUNNING) { return; }
+    if(leader->sample_count < SYNC_MIN_SAMPLES || leader->downbeat_ns == 0 || leader->unit == 0) { return; }
+
+    if(status.bpm != leader->bpm || status.beats != leader->beats || status.unit != leader->unit) {
+        if(!metronome_change_queued(m)) {
+            metronome_queue_change(m, leader->bpm, leader->beats, leader->unit, QUANTIZE_BAR);
+        }
+        s->joined = 0x0;
+        return;
+    }
+
+    if(s->posted) {
+        // measure again only once the correction has played out
+        const uint64_t settled = __atomic_load_n(&m->sync.settled_frame, __ATOMIC_ACQUIRE);
+        if(settled == s->settled_frame || status.frame <= settled) { return; }
+        s->settled_frame = settled;
+        s->posted = 0x0;
+    }
+
+    const int64_t bar = (int64_t)(leader->beats * beat_ns(leader->bpm, leader->unit));
+    const int64_t target = leader->downbeat_ns - leader->offset_ns;
+    int64_t error = (status_downbeat(&status) - target) % bar;
+    if(error >= bar/2)  { error -= bar; }
+    if(error < -bar/2)  { error += bar; }
+    const double error_samples = (double)error * SAMPLE_RATE / 1e9;
+
+    if(!s->joined) {
+        if(!post_adjust(s, -error_samples, status.beats, 0x1)) { return; }
+        s->joined = 0x1;
+        s->phase_error = 0.0;
+        return;
+    }
+
+    s->phase_error += 0.5 * (error_samples - s->phase_error);
+
+    const double bar_samples = (double)bar * SAMPLE_RATE / 1e9;
+    double ratio = load_ratio(m) - 0.2 * s->phase_error / bar_samples;
+    if(ratio > 1.0 + SYNC_MAX_TRIM) { ratio = 1.0 + SYNC_MAX_TRIM; }
+    if(ratio < 1.0 - SYNC_MAX_TRIM) { ratio = 1.0 - SYNC_MAX_TRIM; }
+    store_ratio(m, ratio);
+
+    if(fabs(s->phase_error) > SYNC_DEADBAND) {
+        const double adjust = fmax(-SYNC_SLEW, fmin(SYNC_SLEW, -s->phase_error));
+        if(post_adjust(s, adjust, 1, 0x0)) {
+            s->phase_error += adjust;
+        }
+    }
+}
+
+static void *sync_loop(void *arg) {
+    struct SyncServer *s = arg;
+    struct pollfd fds = {.fd = s->fd, .events = POLLIN};
+
+    while(__atomic_load_n(&s->running, __ATOMIC_ACQUIRE)) {
+        int64_t now = now_ns();
+        const int64_t wait = s->sent_ns + SYNC_INTERVAL_NS - now;
+        fds.revents = 0;
+        poll(&fds, 1, wait > 0 ? (int)(wait / 1000000) + 1 : 0);
+
+        uint8_t fresh = 0x0;
+        if(fds.revents & POLLIN) {
+            struct SyncPeer *p;
+            while(receive_packet(s, &p)) {
+                if(p && p->id == s->leader) { fresh = 0x1; }
+            }
+        }
+
+        now = now_ns();
+        if(now - s->sent_ns >= SYNC_INTERVAL_NS) {
+            send_packet(s, now);
+        }
+        expire_peers(s, now);
+
+        struct SyncPeer *leader = elect_leader(s, now);
+        const uint64_t leader_id = leader ? leader->id : s->id;
+        if(leader_id != s->leader) {
+            s->leader = leader_id;
+            s->joined = 0x0;
+            s->posted = 0x0;
+            store_ratio(s->m, 1.0);
+        }
+        if(leader && fresh) {
+            follow(s, leader);
+        }
+    }
+    return NULL;
+}
+
+int metronome_sync_start(struct SyncServer *s, struct Metronome *m, const uint16_t port) {
+    memset(s, 0, sizeof(*s));
+    s->m = m;
+    s->port = port;
+    s->started_ns = now_ns();
+
+    // random enough to tell processes apart, even on one host
+    struct timespec seed;
+    clock_gettime(CLOCK_REALTIME, &seed);
+    s->id = ((uint64_t)getpid() << 40) ^ ((uint64_t)seed.tv_sec << 20) ^ (uint64_t)seed.tv_nsec;
+    s->leader = s->id;
+
+    if(m->status == NULL) {
+        if(metronome_status_open(m, NULL) != 0) { return -1; }
+        s->own_status = 0x1;
+    }
+
+    s->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(s->fd < 0) {
+        perror("sync socket");
+        return -1;
+    }
+    const int yes = 1;
+    const unsigned char loop = 1, ttl = 1;
+    setsockopt(s->fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    setsockopt(s->fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+    setsockopt(s->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    setsockopt(s->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_ANY)};
+    struct ip_mreq group = {.imr_interface.s_addr = htonl(INADDR_ANY)};
+    inet_pton(AF_INET, SYNC_GROUP, &group.imr_multiaddr);
+    if(bind(s->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+    || setsockopt(s->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &group, sizeof(group)) != 0) {
+        perror("sync socket");
+        close(s->fd);
+        return -1;
+    }
+
+    s->running = 0x1;
+    if(pthread_create(&s->thread, NULL, sync_loop, s) != 0) {
+        close(s->fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Leaves the engine where it is, only the rate trim is dropped. Call once
+// the device has stopped if the status block is our own.
+void metronome_sync_stop(struct SyncServer *s) {
+    __atomic_store_n(&s->running, 0x0, __ATOMIC_RELEASE);
+    pthread_join(s->thread, NULL);
+    close(s->fd);
+    store_ratio(s->m, 1.0);
+    if(s->own_status) {
+        metronome_status_close(s->m, NULL);
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+struct Metronome;
+
+#define SYNC_GROUP          "239.255.77.77"
+#define SYNC_PORT           7777
+#define MAX_SYNC_PEERS      16
+#define SYNC_SAMPLES        16
+
+// One clock offset measurement against a peer, NTP style.
+struct SyncSample {
+    int64_t local_ns;
+    int64_t offset_ns;      // peer clock minus ours
+    int64_t delay_ns;       // round trip without the peer's hold time
+};
+
+struct SyncPeer {
+    uint64_t id;
+    uint32_t uptime_ms;
+    int64_t last_seen_ns;
+
+    // echoed back in our next packet so the peer can measure us
+    int64_t origin_ns;
+    int64_t received_ns;
+
+    // its transport, downbeat_ns is on the peer's clock
+    uint32_t bpm;
+    uint8_t state;
+    uint8_t beats;
+    uint8_t unit;
+    int64_t downbeat_ns;
+
+    struct SyncSample samples[SYNC_SAMPLES];
+    uint32_t sample_count;
+    int64_t offset_ns;
+    double drift_ppm;
+};
+
+// Every peer multicasts its tempo and bar phase ten times a second. The
+// peer that has been up the longest leads, everyone else estimates the
+// offset and drift of its clock and nudges their own engine onto its
+// downbeats. A late joiner never takes the lead and so never moves the
+// players already in time.
+struct SyncServer {
+    struct Metronome *m;
+    int fd;
+    pthread_t thread;
+    uint8_t running;
+    uint8_t own_status;     // opened m->status ourselves
+    uint16_t port;
+
+    uint64_t id;
+    int64_t started_ns;
+    int64_t sent_ns;
+
+    struct SyncPeer peers[MAX_SYNC_PEERS];
+    uint8_t peer_count;
+
+    // follower state
+    uint64_t leader;
+    uint8_t joined;
+    uint8_t posted;
+    uint64_t settled_frame;
+    double phase_error;     // smoothed, in samples
+};
+
+extern int metronome_sync_start(struct SyncServer *s, struct Metronome *m, uint16_t port);
+extern void metronome_sync_stop(struct SyncServer *s);
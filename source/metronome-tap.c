@@ -0,0 +1,66 @@
+#include "metronome-tap.h"
+#include "metronome.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+// Take it as close to reading the key or the socket as possible.
+int64_t metronome_tap_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int compare_interval(const void *a, const void *b) {
+    const int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Mean of the intervals near the median, 0 unless most of them are.
+static double estimate(const struct TapTempo *t) {
+    int64_t sorted[TAP_WINDOW];
+    for(uint8_t i=0; i<t->count; ++i) { sorted[i] = t->intervals[i]; }
+    qsort(sorted, t->count, sizeof(int64_t), compare_interval);
+    const double median = (t->count % 2) ? sorted[t->count/2] : (sorted[t->count/2-1] + sorted[t->count/2]) / 2.0;
+
+    double sum = 0.0;
+    uint8_t inliers = 0;
+    for(uint8_t i=0; i<t->count; ++i) {
+        if(sorted[i] >= median * (1.0-TAP_TOLERANCE) && sorted[i] <= median * (1.0+TAP_TOLERANCE)) {
+            sum += sorted[i];
+            inliers++;
+        }
+    }
+    return (inliers*2 > t->count) ? sum / inliers : 0.0;
+}
+
+// Records a tap taken at ns. From the TAP_MIN_TAPS'th on, the estimate is
+// queued to take over at the next bar line, or straight away while
+// stopped. Returns it in bpm_t, 0 while there is none yet.
+uint32_t metronome_tap(struct Metronome *m, struct TapTempo *t, const int64_t ns) {
+    const int64_t interval = ns - t->last_ns;
+    if(t->taps > 0 && interval < TAP_DEBOUNCE_NS) { return 0; }
+
+    if(t->taps == 0 || interval > TAP_TIMEOUT_NS) {
+        t->count = 0;
+        t->head  = 0;
+        t->taps  = 0;
+    } else {
+        t->intervals[t->head] = interval;
+        t->head = (t->head+1) % TAP_WINDOW;
+        if(t->count < TAP_WINDOW) { t->count++; }
+    }
+    t->last_ns = ns;
+    t->taps++;
+    if(t->taps < TAP_MIN_TAPS) { return 0; }
+
+    const double beat_ns = estimate(t);
+    if(beat_ns <= 0.0) { return 0; }
+
+    // a beat of the active measure, in quarter note bpm like m->bpm
+    const uint8_t unit = m->track.measures[m->track.active_measure].unit;
+    const bpm_t bpm = BPM(60e9 / beat_ns * 4.0 / (unit ? unit : 4));
+    metronome_queue_change(m, bpm, 0, 0, QUANTIZE_BAR);
+    if(m->state == METRONOME_STOPPED) { m->base_bpm = m->bpm; }
+    return bpm;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+struct Metronome;
+
+#define TAP_WINDOW          8               // intervals the estimate looks at
+#define TAP_MIN_TAPS        4               // one bar of 4/4 counted in
+#define TAP_TIMEOUT_NS      (2000000000)    // a longer pause starts a new tempo
+#define TAP_DEBOUNCE_NS     (60000000)      // anything closer is a key bounce
+#define TAP_TOLERANCE       0.2             // intervals this far off the median are outliers
+
+// Taps are beats of the active measure. Intervals go into a sliding
+// window, and the tempo is the mean of those close to the window's
+// median, so a missed or doubled tap does not throw it.
+struct TapTempo {
+    int64_t last_ns;
+    int64_t intervals[TAP_WINDOW];
+    uint8_t head;
+    uint8_t count;
+    uint32_t taps;
+};
+
+extern int64_t metronome_tap_now(void);
+extern uint32_t metronome_tap(struct Metronome *m, struct TapTempo *t, int64_t ns);
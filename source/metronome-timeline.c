@@ -0,0 +1,70 @@
+#include "metronome-timeline.h"
+#include "metronome.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNK_FRAMES    (4096)
+#define CHANNELS        (2)
+
+static void timeline_add(struct Timeline *t, const struct BeatEvent *event) {
+    if(t->count == t->capacity) {
+        t->capacity = t->capacity ? t->capacity*2 : 1024;
+        t->beats = realloc(t->beats, t->capacity * sizeof(struct TimelineBeat));
+    }
+    t->beats[t->count++] = (struct TimelineBeat){event->frame, event->measure, event->beat, event->count_in, event->silent};
+}
+
+// Plays the session offline like metronome-batch does, draining the beat
+// ring after every chunk. Practice programs run until they stop
+// themselves, plain tracks for the requested number of passes, and
+// either is cut off after max_frames.
+void metronome_timeline_build(struct Metronome *m, const unsigned int loops, const uint64_t max_frames, struct Timeline *t) {
+    float chunk[CHUNK_FRAMES*CHANNELS];
+    const uint8_t practice = (m->practice_count > 0);
+    const uint8_t first = m->track.looping ? m->track.loop_from : 0;
+
+    if(practice) {
+        m->practice_autostop = 0x1;
+        metronome_practice_start(m, 0);
+    }
+    metronome_start(m);
+
+    uint32_t tail = m->beat_head;
+    unsigned int passes = 0;
+    uint64_t frames = 0;
+    while(m->state != METRONOME_STOPPED && frames < max_frames) {
+        memset(chunk, 0, sizeof(chunk));
+        metronome_render(m, chunk, CHUNK_FRAMES, CHANNELS);
+        frames += CHUNK_FRAMES;
+
+        struct BeatEvent events[BEAT_EVENTS];
+        const uint32_t head = metronome_read_beats(m, tail, events, BEAT_EVENTS);
+        for(uint32_t i=0; i<head-tail && i<BEAT_EVENTS; ++i) {
+            const struct BeatEvent *event = &events[i];
+            if(!practice && !event->count_in && event->beat == 0 && event->measure == first && ++passes > loops) {
+                t->end = event->frame;
+                return;
+            }
+            if(event->frame >= max_frames) {
+                t->end = event->frame;
+                return;
+            }
+            timeline_add(t, event);
+        }
+        tail = head;
+    }
+    // a finished program stops on the bar line it would have played next
+    t->end = (m->state == METRONOME_STOPPED) ? m->engine.bar_frame : frames;
+}
+
+void metronome_timeline_free(struct Timeline *t) {
+    free(t->beats);
+    t->beats = NULL;
+    t->count = 0;
+    t->capacity = 0;
+}
+
+const struct Measure *metronome_timeline_measure(const struct Metronome *m, const struct TimelineBeat *beat) {
+    return beat->count_in ? &m->count_in : &m->track.measures[beat->measure];
+}
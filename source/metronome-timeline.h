@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct Metronome;
+struct Measure;
+
+struct TimelineBeat {
+    uint64_t frame;
+    uint8_t measure;
+    uint8_t beat;
+    uint8_t count_in;
+    uint8_t silent;
+};
+
+// Every beat the engine plays, at the exact frame it plays it. Exports
+// and take analysis are derived from this, never from the bpm.
+struct Timeline {
+    struct TimelineBeat *beats;
+    size_t count;
+    size_t capacity;
+    uint64_t end;       // frame the beat after the last one would fall on
+};
+
+extern void metronome_timeline_build(struct Metronome *m, unsigned int loops, uint64_t max_frames, struct Timeline *t);
+extern void metronome_timeline_free(struct Timeline *t);
+extern const struct Measure *metronome_timeline_measure(const struct Metronome *m, const struct TimelineBeat *beat);
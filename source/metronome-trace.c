@@ -0,0 +1,134 @@
+#include "metronome-trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct Trace *metronome_tracing = NULL;
+
+static struct Trace trace;
+static __thread int32_t own_ring = -1;  // -2 once every ring is taken
+
+int metronome_trace_open(void) {
+    trace.rings = malloc(TRACE_THREADS * sizeof(struct TraceRing));
+    if(trace.rings == NULL) { return -1; }
+
+    // touched once here so recording never takes a page fault
+    memset(trace.rings, 0, TRACE_THREADS * sizeof(struct TraceRing));
+    trace.ring_count = 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    trace.start_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    __atomic_store_n(&metronome_tracing, &trace, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Call once the traced threads are done, anything still recording would
+// write into freed rings.
+void metronome_trace_close(void) {
+    if(metronome_tracing == NULL) { return; }
+
+    __atomic_store_n(&metronome_tracing, NULL, __ATOMIC_RELEASE);
+    free(trace.rings);
+    trace.rings = NULL;
+}
+
+static struct TraceRing *own(const char *thread) {
+    if(own_ring == -1) {
+        const uint32_t index = __atomic_fetch_add(&trace.ring_count, 1, __ATOMIC_RELAXED);
+        if(index >= TRACE_THREADS) {
+            own_ring = -2;
+            return NULL;
+        }
+        trace.rings[index].tid = index+1;
+        trace.rings[index].thread = thread;
+        own_ring = index;
+    }
+    return (own_ring >= 0) ? &trace.rings[own_ring] : NULL;
+}
+
+static void record(const char *category, const char *name, const int64_t ns, const int64_t duration_ns) {
+    if(__atomic_load_n(&metronome_tracing, __ATOMIC_ACQUIRE) == NULL) { return; }
+    struct TraceRing *ring = own(category);
+    if(ring == NULL) { return; }
+
+    struct TraceEvent *event = &ring->events[ring->head % TRACE_EVENTS];
+    event->ns = ns;
+    event->duration_ns = duration_ns;
+    event->category = category;
+    strncpy(event->name, name, TRACE_NAME_SIZE-1);
+    event->name[TRACE_NAME_SIZE-1] = '\0';
+    __atomic_store_n(&ring->head, ring->head+1, __ATOMIC_RELEASE);
+}
+
+// Names the calling thread in the trace, before its first event.
+void metronome_trace_thread(const char *name) {
+    if(__atomic_load_n(&metronome_tracing, __ATOMIC_ACQUIRE) == NULL) { return; }
+    own(name);
+}
+
+// begin_ns from metronome_trace_begin(), 0 if tracing was off back then
+void metronome_trace_span(const char *category, const char *name, const int64_t begin_ns) {
+    if(begin_ns == 0) { return; }
+    const int64_t end_ns = metronome_trace_begin();
+    if(end_ns == 0) { return; }
+    record(category, name, begin_ns, end_ns - begin_ns);
+}
+
+void metronome_trace_instant(const char *category, const char *name) {
+    const int64_t ns = metronome_trace_begin();
+    if(ns == 0) { return; }
+    record(category, name, ns, -1);
+}
+
+// names can come from control clients, nothing in them may end the string
+static void write_name(FILE *f, const char *name) {
+    for(const char *c=name; *c; ++c) {
+        fputc((*c == '"' || *c == '\\' || (unsigned char)*c < 0x20) ? '_' : *c, f);
+    }
+}
+
+// Chrome trace event format, loads in Perfetto and chrome://tracing.
+// Timestamps are microseconds from metronome_trace_open().
+int metronome_trace_write(const char *path) {
+    if(metronome_tracing == NULL) { return -1; }
+
+    FILE *f = fopen(path, "w");
+    if(f == NULL) {
+        perror(path);
+        return -1;
+    }
+    const int pid = getpid();
+    const uint32_t ring_count = __atomic_load_n(&trace.ring_count, __ATOMIC_ACQUIRE);
+    uint8_t first = 0x1;
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    for(uint32_t r=0; r<ring_count && r<TRACE_THREADS; ++r) {
+        const struct TraceRing *ring = &trace.rings[r];
+        const uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        const uint32_t tail = (head > TRACE_EVENTS) ? head - TRACE_EVENTS : 0;
+
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+            first ? "" : ",\n", pid, ring->tid, ring->thread);
+        first = 0x0;
+
+        for(uint32_t i=tail; i<head; ++i) {
+            const struct TraceEvent *event = &ring->events[i % TRACE_EVENTS];
+            fprintf(f, ",\n{\"name\":\"");
+            write_name(f, event->name);
+            fprintf(f, "\",\"cat\":\"%s\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f",
+                event->category, pid, ring->tid, (event->ns - trace.start_ns) / 1e3);
+            if(event->duration_ns < 0) {
+                fprintf(f, ",\"ph\":\"i\",\"s\":\"t\"}");
+            } else {
+                fprintf(f, ",\"ph\":\"X\",\"dur\":%.3f}", event->duration_ns / 1e3);
+            }
+        }
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    const int failed = ferror(f);
+    fclose(f);
+    return failed ? -1 : 0;
+}
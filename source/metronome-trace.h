@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#define TRACE_THREADS       8
+#define TRACE_EVENTS        8192    // per thread, the oldest are overwritten
+#define TRACE_NAME_SIZE     24
+
+struct TraceEvent {
+    int64_t ns;             // CLOCK_MONOTONIC
+    int64_t duration_ns;    // -1 for an instant
+    const char *category;   // a string literal
+    char name[TRACE_NAME_SIZE];
+};
+
+// Written only by the thread that claimed it, so recording never takes a
+// lock. head counts every event, the ring keeps the last TRACE_EVENTS.
+struct TraceRing {
+    uint32_t head;
+    uint32_t tid;
+    const char *thread;     // metronome_trace_thread(), else the first event's category
+    struct TraceEvent events[TRACE_EVENTS];
+};
+
+struct Trace {
+    int64_t start_ns;
+    uint32_t ring_count;
+    struct TraceRing *rings;
+};
+
+// NULL unless metronome_trace_open() was called, every probe costs a
+// load and a branch then.
+extern struct Trace *metronome_tracing;
+
+extern int metronome_trace_open(void);
+extern int metronome_trace_write(const char *path);
+extern void metronome_trace_close(void);
+
+extern void metronome_trace_thread(const char *name);
+extern void metronome_trace_span(const char *category, const char *name, int64_t begin_ns);
+extern void metronome_trace_instant(const char *category, const char *name);
+
+static inline int64_t metronome_trace_begin(void) {
+    if(__atomic_load_n(&metronome_tracing, __ATOMIC_RELAXED) == NULL) { return 0; }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
@@ -1,10 +1,17 @@
 #include <ncurses.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "metronome.h"
+#include "metronome-autosave.h"
+#include "metronome-history.h"
+#include "metronome-indicator.h"
+#include "metronome-tap.h"
+#include "metronome-trace.h"
 
 #define COMMAND_MAX_LEN 256
 
@@ -23,6 +30,12 @@ const char* mode_string(const ProgramMode mode) {
 
 typedef enum {BEAT_SELECTED, UNIT_SELECTED, BPM_SELECTED, NONE_SELECTED} SelectionState;
 
+static const char *program_names[PROGRAM_COUNT] = {"", "random", "bursts", "dropout", "cycle"};
+
+// the beat being heard, not the one the callback is rendering
+static struct Indicator indicator;
+static uint8_t show_progress = 0x0;
+
 void init_tui() {
     initscr();
     cbreak();
@@ -43,12 +56,12 @@ void tui_print(const struct Metronome *m, WINDOW *win, const ProgramMode mode, c
 
     SelectionState selection = (mode==PAUSE_MODE) ? state : NONE_SELECTED;
 
-    int len = snprintf(NULL, 0, "Metronome at %d BPM", m->bpm);
+    int len = snprintf(NULL, 0, "Metronome at %g BPM", BPM_FLOAT(m->bpm));
     int left = (x-len)/2;
 
     mvwprintw(win, 3, left, "Metronome at ");
     if(selection == BPM_SELECTED) { wattron(win, COLOR_PAIR(2)); wattron(win, A_UNDERLINE); }
-    wprintw(win, "%d", m->bpm);
+    wprintw(win, "%g", BPM_FLOAT(m->bpm));
     if(selection == BPM_SELECTED) { wattroff(win, COLOR_PAIR(2)); wattroff(win, A_UNDERLINE); }
     wprintw(win, " BPM");
 
@@ -86,14 +99,47 @@ void print_practice_info(const struct Metronome *m, WINDOW *win) {
     int x, y;
     getmaxyx(win, y, x);
 
-    const struct Track *t = &m->track;
-    const int measures_left = p->interval - p->iteration;
+    if(p->program != PROGRAM_NONE) {
+        char line[96];
+        const int len = p->bars
+            ? snprintf(line, sizeof(line), "%s at %g BPM, bar %u of %u, seed %u", program_names[p->program], BPM_FLOAT(m->bpm), p->iteration+1, p->bars, p->seed)
+            : snprintf(line, sizeof(line), "%s at %g BPM, bar %u, seed %u", program_names[p->program], BPM_FLOAT(m->bpm), p->iteration+1, p->seed);
+        mvwprintw(win, 2, (x-len)/2, "%s%s", line, m->practice_silent ? " (silent)" : "");
+        if (m->practice_count > 1) {
+            mvwprintw(win, 1, (x-9)/2, "set %d/%d", m->practice_current+1, m->practice_count);
+        }
+        wrefresh(win);
+        return;
+    }
 
-    const char *format = "Adding %d BPM in %d repititions";
+    const struct Track *t = &m->track;
+    const int ramping = (p->curve != PRACTICE_STEP);
+    int measures_left = 0;
+    double bpm = 0.0;
+    const char *format = NULL;
+    switch(p->stage) {
+        case PRACTICE_PLATEAU:
+            format = "Holding %g BPM for %d repititions";
+            bpm = BPM_FLOAT(p->bpm_to);
+            measures_left = p->plateau - (int)p->iteration;
+            break;
+        case PRACTICE_REBOUND:
+            format = "Rebound at %g BPM for %d repititions";
+            bpm = BPM_FLOAT(m->bpm);
+            measures_left = p->interval - (int)p->iteration;
+            break;
+        default:
+            format = ramping ? "Ramping to %g BPM in %d repititions" : "Adding %g BPM in %d repititions";
+            bpm = BPM_FLOAT(ramping ? p->bpm_to : p->bpm_step);
+            measures_left = ramping
+                ? (int)metronome_practice_length(p) - (int)p->iteration
+                : p->interval - (int)p->iteration;
+            break;
+    }
     int len = snprintf(
         NULL, 0, 
         format, 
-        p->bpm_step, measures_left//, p->bpm_from, p->bpm_to, p->interval
+        bpm, measures_left//, p->bpm_from, p->bpm_to, p->interval
     );
 
     if (p->interval > 0) {
@@ -102,20 +148,50 @@ void print_practice_info(const struct Metronome *m, WINDOW *win) {
             2,
             (x-len)/2, 
             format, 
-            p->bpm_step, measures_left//, p->bpm_from, p->bpm_to, p->interval
+            bpm, measures_left//, p->bpm_from, p->bpm_to, p->interval
         );
+        if (m->practice_count > 1) {
+            mvwprintw(win, 1, (x-9)/2, "set %d/%d", m->practice_current+1, m->practice_count);
+        }
     }
     wrefresh(win);
 }
 
 
+const char* accent_mark(const uint8_t level) {
+    switch(level) {
+        case ACCENT_MUTE:     return "x";
+        case ACCENT_GHOST:    return ".";
+        case ACCENT_STRONG:   return ">";
+        case ACCENT_DOWNBEAT: return "!";
+        default:              return " ";
+    }
+}
+
+// With --progress the cursor sweeps from beat to beat, otherwise it
+// jumps on each one as it is heard.
+static void draw_cursor(const struct Metronome *m, WINDOW *win) {
+    int x, y;
+    getmaxyx(win, y, x);
+    const uint8_t heard = indicator.playing && !indicator.current.count_in;
+    const struct Measure *measure = &m->track.measures[heard ? indicator.current.measure : m->track.active_measure];
+    const int margin = 5;
+    const uint8_t len = x -2*margin;
+    const int step = len/(measure->beats-1);
+
+    const float beat = indicator.playing ? indicator.current.beat + (show_progress ? indicator.progress : 0.f) : 0.f;
+    wmove(win, y/2 +2, 1);
+    for(int i=1; i<x-1; ++i) { waddch(win, ' '); }
+    mvwprintw(win, y/2 +2, (x-len)/2 + (int)(step*beat), "^");
+}
+
 void update_display(struct Metronome *m, WINDOW *win, const ProgramMode mode) {
+    const int64_t begin_ns = metronome_trace_begin();
     wclear(win);
 
     box(win, 0, 0);
 
-    int x, y;
-    getmaxyx(win, y, x);
+    const int y = getmaxy(win);
 
     if (m->practice_active) {
         print_practice_info(m, win);
@@ -124,11 +200,13 @@ void update_display(struct Metronome *m, WINDOW *win, const ProgramMode mode) {
     {
         tui_print(m, win, mode, NONE_SELECTED);
 
+        const uint8_t heard = indicator.playing && !indicator.current.count_in;
+        const struct Measure *measure = &m->track.measures[heard ? indicator.current.measure : m->track.active_measure];
         const int margin = 5;
         uint8_t len = getmaxx(win) -2*margin;
-        int step = len/(m->track.measures[m->track.active_measure].beats-1);
+        int step = len/(measure->beats-1);
 
-        for(int i=0; i<m->track.measures[m->track.active_measure].beats; ++i) {
+        for(int i=0; i<measure->beats; ++i) {
             mvwprintw(
                 win,
                 y/2 +1, 
@@ -136,14 +214,10 @@ void update_display(struct Metronome *m, WINDOW *win, const ProgramMode mode) {
                 "%d", 
                 i+1
             );
+            mvwprintw(win, y/2, i*step + margin, "%s", accent_mark(measure->accents[i]));
         }
-        mvwprintw(
-            win,
-            y/2 +2, 
-            (x-len)/2 + step*(m->tick!=0 ? m->tick-1 : m->tick), 
-            "^" 
-        );
-        if (m->tick == 1) {
+        draw_cursor(m, win);
+        if (indicator.playing && indicator.current.beat == 0) {
             wbkgd(win, COLOR_PAIR(1));
         } else {
             wbkgd(win, 0);
@@ -153,11 +227,23 @@ void update_display(struct Metronome *m, WINDOW *win, const ProgramMode mode) {
     wmove(stdscr, LINES-2, 0);
     wclrtoeol(stdscr);
     wprintw(stdscr, "%s", mode_string(mode));//"-- NORMAL --");
+    if(m->realtime) {
+        char granted[64];
+        metronome_realtime_describe(__atomic_load_n(&m->realtime_granted, __ATOMIC_ACQUIRE), granted, sizeof(granted));
+        wprintw(stdscr, "  realtime: %s", granted);
+    }
     refresh();
     wrefresh(win);
+    metronome_trace_span("ui", "update_display", begin_ns);
+}
+
+// measures and beats are counted from 1 on the command line
+static int one_based(const char *str) {
+    const int value = atoi(str);
+    return value > 1 ? value-1 : 0;
 }
 
-int handle_command_mode(struct Metronome *m) {
+int handle_command_mode(struct Metronome *m, struct Autosave *autosave) {
     char cmd[COMMAND_MAX_LEN];
     int ch;
     int result = 0;
@@ -172,12 +258,13 @@ int handle_command_mode(struct Metronome *m) {
     refresh();
 
     wgetnstr(stdscr, cmd, sizeof(cmd)-1);
+    const int64_t begin_ns = metronome_trace_begin();
     char *token = strtok(cmd, " ");
     if(token) {
         if(strcmp(token, "bpm") == 0) {
             char *value_str = strtok(NULL, " ");
             if(value_str) {
-                m->bpm = (double)atoi(value_str);
+                metronome_set_bpm(m, atof(value_str));
                 m->base_bpm = m->bpm;
                 m->tick = 1;
                 m->reset = 0x1;
@@ -238,78 +325,106 @@ int handle_command_mode(struct Metronome *m) {
             m->tick = 1;
         } else if(strcmp(token, "practice") == 0) {
             char *value_str = strtok(NULL, " ");
+            uint8_t curve = PRACTICE_STEP;
+            uint8_t program = PROGRAM_NONE;
             if(value_str) {
-                if(strcmp(value_str, "off") == 0) {
-                    m->reset = 0x1;
-                    m->practice_active = 0x0;
-                    m->tick = 1;
-                    m->practice[m->practice_current].interval = 0;
+                if(strcmp(value_str, "linear") == 0) {
+                    curve = PRACTICE_LINEAR;
+                } else if(strcmp(value_str, "exp") == 0) {
+                    curve = PRACTICE_EXPONENTIAL;
+                }
+                for(uint8_t i=1; i<PROGRAM_COUNT; ++i) {
+                    if(strcmp(value_str, program_names[i]) == 0) { program = i; }
                 }
+            }
+            if(value_str && strcmp(value_str, "off") == 0) {
+                m->reset = 0x1;
+                m->practice_active = 0x0;
+                m->tick = 1;
+                m->practice[m->practice_current].interval = 0;
+            } else if(value_str && strcmp(value_str, "run") == 0) {
+                char *set = strtok(NULL, " ");
+                metronome_practice_start(m, set ? one_based(set) : 0);
+            } else if(value_str && strcmp(value_str, "clear") == 0) {
+                m->reset = 0x1;
+                m->practice_active = 0x0;
+                m->practice_count = 0;
+                m->practice_current = 0;
+                m->tick = 1;
+            } else if(value_str && strcmp(value_str, "autostop") == 0) {
+                char *value = strtok(NULL, " ");
+                m->practice_autostop = !(value && strcmp(value, "off") == 0);
+            } else if(m->practice_count >= MAX_PRACTICE_SETS) {
+                mvprintw(LINES-1, 0, "[ERROR] at most %d practice sets!", MAX_PRACTICE_SETS);
+                refresh();
+                sleep(1);
             } else {
-                struct Practice p = {.iteration=0};
+                struct Practice p = {.iteration=0, .curve=curve, .program=program};
                 { // From bpm
-                    char bpm_step_str[4];
-                    uint16_t bpm_step = 0;
+                    char bpm_str[8];
+                    bpm_t bpm = 0;
 
-                    while(bpm_step<1 || bpm_step>254) {
+                    while(bpm<MIN_BPM || bpm>=MAX_BPM) {
                         move(LINES-1, 0);
                         clrtoeol();
                         printw(":from bpm = ");
                         refresh();
 
-                        wgetnstr(stdscr, bpm_step_str, sizeof(bpm_step_str)-1);
-                        bpm_step = atoi(bpm_step_str);
+                        wgetnstr(stdscr, bpm_str, sizeof(bpm_str)-1);
+                        bpm = BPM(fmax(atof(bpm_str), 0.0));
 
-                        if(bpm_step<1 || bpm_step>254) {
+                        if(bpm<MIN_BPM || bpm>=MAX_BPM) {
                             move(LINES-1, 0);
                             clrtoeol();
-                            printw("[ERROR] bpm must be between 1-254!");
+                            printw("[ERROR] bpm must be between %g-%g!", BPM_FLOAT(MIN_BPM), BPM_FLOAT(MAX_BPM-1));
                             refresh();
                             sleep(1);
                         }
                     }
-                    metronome_practice_set_from_bpm(&p, bpm_step);
+                    metronome_practice_set_from_bpm(&p, bpm);
                 }
-                { // To bpm
-                    char bpm_step_str[4];
-                    uint16_t bpm_step = 0;
+                if(program == PROGRAM_DROPOUT) {
+                    p.bpm_to = p.bpm_from;
+                } else { // To bpm, below from makes it a ritardando
+                    char bpm_str[8];
+                    bpm_t bpm = 0;
 
-                    while(bpm_step<1 || bpm_step<=p.bpm_from || bpm_step>255) {
+                    while(bpm<MIN_BPM || bpm==p.bpm_from || bpm>MAX_BPM) {
                         move(LINES-1, 0);
                         clrtoeol();
                         printw(":to bpm = ");
                         refresh();
 
-                        wgetnstr(stdscr, bpm_step_str, sizeof(bpm_step_str)-1);
-                        bpm_step = atoi(bpm_step_str);
+                        wgetnstr(stdscr, bpm_str, sizeof(bpm_str)-1);
+                        bpm = BPM(fmax(atof(bpm_str), 0.0));
 
-                        if(bpm_step<1 || bpm_step <= p.bpm_from || bpm_step>255) {
+                        if(bpm<MIN_BPM || bpm==p.bpm_from || bpm>MAX_BPM) {
                             move(LINES-1, 0);
                             clrtoeol();
-                            printw("[ERROR] bpm target must be greater than from (%d) and between 1-255!", p.bpm_from);
+                            printw("[ERROR] bpm target must differ from (%g) and be between %g-%g!", BPM_FLOAT(p.bpm_from), BPM_FLOAT(MIN_BPM), BPM_FLOAT(MAX_BPM));
                             refresh();
                             sleep(1);
                         }
                     }
-                    p.bpm_to = bpm_step;
+                    p.bpm_to = bpm;
                 }
-                { // bpm step size
-                    char bpm_step_str[4];
-                    uint8_t bpm_step = 0;
+                if(program != PROGRAM_BURSTS && program != PROGRAM_DROPOUT) { // bpm step size
+                    char bpm_step_str[8];
+                    bpm_t bpm_step = 0;
 
-                    while(bpm_step<1 || bpm_step>10) {
+                    while(bpm_step<1 || bpm_step>BPM(10)) {
                         move(LINES-1, 0);
                         clrtoeol();
                         printw(":bpm step = ");
                         refresh();
                     
                         wgetnstr(stdscr, bpm_step_str, sizeof(bpm_step_str)-1);
-                        bpm_step = atoi(bpm_step_str);
+                        bpm_step = BPM(fmax(atof(bpm_step_str), 0.0));
 
-                        if(bpm_step<1 || bpm_step>10) {
+                        if(bpm_step<1 || bpm_step>BPM(10)) {
                             move(LINES-1, 0);
                             clrtoeol();
-                            printw("[ERROR] bpm step must be between 1-10!");
+                            printw("[ERROR] bpm step must be between %g-10!", BPM_FLOAT(1));
                             refresh();
                             sleep(1);
                         }
@@ -339,15 +454,95 @@ int handle_command_mode(struct Metronome *m) {
                     }
                     p.interval = interval;
                 }
-                m->reset = 0x1;
-                m->tick = 1;
-                m->practice_current = m->practice_count;
-                m->bpm = p.bpm_from;
+                if(program != PROGRAM_NONE) { // length, empty input plays it forever
+                    char bars_str[8];
+                    move(LINES-1, 0);
+                    clrtoeol();
+                    printw(":bars = ");
+                    refresh();
 
-                memcpy(&m->practice[m->practice_count++], &p, sizeof(p));
+                    wgetnstr(stdscr, bars_str, sizeof(bars_str)-1);
+                    p.bars = (atoi(bars_str) > 0) ? atoi(bars_str) : 0;
+                }
+                if(program == PROGRAM_DROPOUT) { // how many bars go silent by the end
+                    char dropout_str[4];
+                    move(LINES-1, 0);
+                    clrtoeol();
+                    printw(":dropout %% = ");
+                    refresh();
+
+                    wgetnstr(stdscr, dropout_str, sizeof(dropout_str)-1);
+                    const int dropout = atoi(dropout_str);
+                    p.dropout = (dropout < 0) ? 0 : (dropout > 100 ? 100 : dropout);
+                }
+                if(program != PROGRAM_NONE) { // the same seed replays the same program, empty input picks one
+                    char seed_str[12];
+                    move(LINES-1, 0);
+                    clrtoeol();
+                    printw(":seed = ");
+                    refresh();
+
+                    wgetnstr(stdscr, seed_str, sizeof(seed_str)-1);
+                    p.seed = seed_str[0] ? strtoul(seed_str, NULL, 10) : (uint32_t)time(NULL);
+                }
+                if(program == PROGRAM_NONE) { // optional plateau at the target, empty input skips it
+                    char plateau_str[4];
+                    move(LINES-1, 0);
+                    clrtoeol();
+                    printw(":plateau = ");
+                    refresh();
+
+                    wgetnstr(stdscr, plateau_str, sizeof(plateau_str)-1);
+                    const int plateau = atoi(plateau_str);
+                    p.plateau = (plateau < 0) ? 0 : (plateau > 100 ? 100 : plateau);
+                }
+                if(program == PROGRAM_NONE) { // optional step-down rebound after the plateau
+                    char rebound_str[8];
+                    move(LINES-1, 0);
+                    clrtoeol();
+                    printw(":rebound bpm = ");
+                    refresh();
 
-                m->track.active_measure = 0;
-                m->practice_active = 0x1;
+                    wgetnstr(stdscr, rebound_str, sizeof(rebound_str)-1);
+                    p.rebound = BPM(fmin(fmax(atof(rebound_str), 0.0), BPM_FLOAT(p.bpm_to)));
+                }
+                memcpy(&m->practice[m->practice_count++], &p, sizeof(p));
+                metronome_practice_start(m, m->practice_count-1);
+            }
+        } else if(strcmp(token, "accent") == 0) {
+            static const char *levels[ACCENT_COUNT] = {"auto", "mute", "ghost", "normal", "strong", "down"};
+            char *beat = strtok(NULL, " ");
+            char *level = strtok(NULL, " ");
+            if(beat && level) {
+                for(uint8_t i=0; i<ACCENT_COUNT; ++i) {
+                    if(strcmp(level, levels[i]) == 0) {
+                        metronome_set_accent(m, one_based(beat), i);
+                    }
+                }
+            }
+        } else if(strcmp(token, "group") == 0) {
+            char *grouping = strtok(NULL, " ");
+            if(!grouping || metronome_set_grouping(m, grouping) != 0) {
+                mvprintw(LINES-1, 0, "[ERROR] grouping must look like 2+2+3!");
+                refresh();
+                sleep(1);
+            }
+            m->reset = 0x1;
+            m->tick = 1;
+        } else if(strcmp(token, "seek") == 0) {
+            char *measure = strtok(NULL, " ");
+            char *beat = strtok(NULL, " ");
+            if(measure) {
+                metronome_seek(m, one_based(measure), beat ? one_based(beat) : 0);
+            }
+        } else if(strcmp(token, "loop") == 0) {
+            char *from = strtok(NULL, " ");
+            char *to = strtok(NULL, " ");
+            if(from && strcmp(from, "off") == 0) {
+                metronome_clear_loop(m);
+            } else if(from && to) {
+                metronome_set_loop(m, one_based(from), one_based(to));
+                metronome_seek(m, m->track.loop_from, 0);
             }
         } else if(strcmp(token, "reset") == 0) {
             m->bpm = m->base_bpm;
@@ -355,13 +550,18 @@ int handle_command_mode(struct Metronome *m) {
             m->reset = 0x1;
             m->tick = 1;
         } else if(strcmp(token, "w") == 0) {
-            metronome_save(m, NULL);
+            if(autosave) {
+                metronome_autosave_flush(autosave);
+            } else {
+                metronome_save(m, NULL);
+            }
         }
 
         else if(strcmp(token, "quit") == 0 || strcmp(token, "q") == 0) {
             result = 1;
         }
     }
+    metronome_trace_span("command", token ? token : "", begin_ns);
     noecho();
     curs_set(0);
     timeout(0);
@@ -371,8 +571,50 @@ int handle_command_mode(struct Metronome *m) {
 }
 
 int main(int argc, char **argv) {
+    // tracing starts before setup so it sees the device open
+    const char *trace_path = NULL;
+    for(int i=1; i+1<argc; ++i) {
+        if(strcmp(argv[i], "--trace") == 0) { trace_path = argv[i+1]; }
+    }
+    if(trace_path && metronome_trace_open() != 0) {
+        trace_path = NULL;
+    }
+    metronome_trace_thread("ui");
+
     struct Metronome metronome;
-    metronome_setup(&metronome);
+    ma_result opened = metronome_setup(&metronome);
+    uint32_t fps = INDICATOR_FPS;
+    for(int i=1; i<argc; ++i) {
+        if(strcmp(argv[i], "--realtime") == 0) {
+            metronome_realtime(&metronome);
+        } else if(strcmp(argv[i], "--idle") == 0 && i+1 < argc) {
+            metronome.idle_ms = atof(argv[++i]) * 1000;
+        } else if(strcmp(argv[i], "--trace") == 0 && i+1 < argc) {
+            ++i;
+        } else if(strcmp(argv[i], "--progress") == 0) {
+            show_progress = 0x1;
+        } else if(strcmp(argv[i], "--fps") == 0 && i+1 < argc) {
+            fps = atoi(argv[++i]);
+        }
+    }
+    // the device has been opening while the arguments were read
+    if(opened == MA_SUCCESS) {
+        opened = metronome_wait_device(&metronome);
+    }
+    if(opened != MA_SUCCESS) {
+        fprintf(stderr, "could not open the playback device: %s\n", ma_result_description(opened));
+        metronome_shutdown(&metronome);
+        return 1;
+    }
+    metronome_indicator_init(&indicator, &metronome, fps);
+
+    // edits are saved as they happen, a crash loses at most the one in flight
+    static struct Autosave autosaving;
+    struct Autosave *autosave = (metronome_autosave_start(&autosaving, &metronome, NULL) >= 0) ? &autosaving : NULL;
+
+    // undo starts from the track as it was loaded
+    static struct History edits;
+    struct History *history = (metronome_history_init(&edits, &metronome) == 0) ? &edits : NULL;
 
     ProgramMode program_mode = NORMAL_MODE;
     SelectionState input_selection = NONE_SELECTED;
@@ -396,22 +638,53 @@ int main(int argc, char **argv) {
 
         struct Coord input_pos = {.x=1, .y=getmaxy(stdscr)};
 
+        struct TapTempo tap = {0};
         uint8_t keep_running = 0x1;
         while (keep_running == 0x1) {
             if(program_mode == NORMAL_MODE || program_mode == PRACTICE_MODE || program_mode == PAUSE_MODE) {
+                // sleeps until a key, the next frame or the next beat
+                wtimeout(win, metronome_indicator_timeout(&indicator));
                 char cmd = wgetch(win);
+                const int64_t read_ns = metronome_tap_now();
+                if(cmd != ERR) {
+                    const char key[] = {'k','e','y',' ', cmd, '\0'};
+                    metronome_trace_instant("ui", key);
+                }
 
                 switch(cmd) {
+                    case 't': {
+                        const bpm_t bpm = metronome_tap(&metronome, &tap, read_ns);
+                        move(LINES-1, 0);
+                        clrtoeol();
+                        if(bpm > 0) {
+                            printw("tap %u: %g bpm%s", tap.taps, BPM_FLOAT(bpm), metronome.state==METRONOME_STOPPED ? "" : " from the next bar");
+                        } else {
+                            printw("tap %u", tap.taps);
+                        }
+                        refresh();
+                        tui_print(&metronome, win, program_mode, input_selection);
+                        break;
+                    }
+                    case 'u': {
+                        if(history) { metronome_history_undo(history, &metronome); }
+                        tui_print(&metronome, win, program_mode, input_selection);
+                        break;
+                    }
+                    case 'r' & 0x1f: {
+                        if(history) { metronome_history_redo(history, &metronome); }
+                        tui_print(&metronome, win, program_mode, input_selection);
+                        break;
+                    }
                     case 'j': {
                         if(program_mode == NORMAL_MODE) {
-                            metronome.bpm--;
+                            metronome_dec_bpm(&metronome);
                         } else if(program_mode == PAUSE_MODE) {
                             if(input_selection == BEAT_SELECTED) {
                             metronome_dec_beats(&metronome);
                             } else if(input_selection == UNIT_SELECTED) {
                                 metronome_dec_unit(&metronome);
                             } else if(input_selection == BPM_SELECTED) {
-                                metronome.bpm--;
+                                metronome_dec_bpm(&metronome);
                             }
                         }
                         //metronome.bpm -= (cmd=='j') ? 1 : 5;
@@ -420,14 +693,14 @@ int main(int argc, char **argv) {
                     } 
                     case 'k': {
                         if(program_mode == NORMAL_MODE) {
-                            metronome.bpm++;
+                            metronome_inc_bpm(&metronome);
                         } else if(program_mode == PAUSE_MODE) {
                             if(input_selection == BEAT_SELECTED) {
                                 metronome_inc_beats(&metronome);
                             } else if(input_selection == UNIT_SELECTED) {
                                 metronome_inc_unit(&metronome);
                             } else if(input_selection == BPM_SELECTED) {
-                                metronome.bpm++;
+                                metronome_inc_bpm(&metronome);
                             }
                         }
                         //metronome.bpm += (cmd=='k') ? 1 : 5;
@@ -562,42 +835,81 @@ int main(int argc, char **argv) {
                         }
                         break;
                     }
+                    case '\n': {
+                        if(program_mode == PAUSE_MODE) {
+                            program_mode = metronome.practice_active ? PRACTICE_MODE : NORMAL_MODE;
+                            metronome.reset = 1;
+                            metronome.tick = 1;
+                            metronome_seek(&metronome, metronome.track.active_measure, 0);
+                            metronome_start(&metronome);
+                            tui_print(&metronome, win, program_mode, input_selection);
+                        }
+                        break;
+                    }
+                }
+                if(cmd != ERR && history) {
+                    metronome_history_commit(history, &metronome);
+                }
+                if(cmd != ERR && autosave) {
+                    metronome_autosave_post(autosave);
                 }
             } 
 
             if(program_mode == COMMAND_MODE) {
-                if(handle_command_mode(&metronome) == 1) {
+                if(handle_command_mode(&metronome, autosave) == 1) {
                     keep_running = 0x0;
                 }
+                if(history) {
+                    metronome_history_commit(history, &metronome);
+                }
+                if(autosave) {
+                    metronome_autosave_post(autosave);
+                }
                 program_mode = metronome.practice_active ? PRACTICE_MODE : NORMAL_MODE;
                 update_display(&metronome, win, program_mode);
                 metronome_start(&metronome);
             }
 
             if(program_mode==PRACTICE_MODE) {
-                if (metronome.bpm >= metronome.practice[metronome.practice_current].bpm_to) {
-                    metronome.practice_active = 0;
-                    program_mode = PAUSE_MODE;
-                    input_selection = BEAT_SELECTED;
-                    metronome_stop(&metronome);
+                // the engine ends the program, this only catches up with it
+                if (!metronome.practice_active) {
+                    if (metronome.state == METRONOME_STOPPED) {
+                        program_mode = PAUSE_MODE;
+                        input_selection = BEAT_SELECTED;
+                        metronome_stop(&metronome);
+                    } else {
+                        program_mode = NORMAL_MODE;
+                    }
                     update_display(&metronome, win, program_mode);
                 }
             }
 
-            if(metronome.tick > 0) {
+            const enum IndicatorChange change = metronome_indicator_update(&indicator, &metronome);
+            if(change == INDICATOR_BEAT) {
                 if(metronome.practice_active && program_mode != PAUSE_MODE) {
                     program_mode = PRACTICE_MODE;
                 }
 
                 update_display(&metronome, win, program_mode);
-                metronome.tick = 0;
-            } 
+            } else if(change == INDICATOR_FRAME && show_progress) {
+                draw_cursor(&metronome, win);
+            }
             wrefresh(win);
             refresh();
         }
     }
     endwin();
+        if(autosave) {
+            metronome_autosave_stop(autosave);
+        }
+        if(history) {
+            metronome_history_free(history);
+        }
         metronome_shutdown(&metronome);
+        if(trace_path) {
+            metronome_trace_write(trace_path);
+            metronome_trace_close();
+        }
 
         return 0;
     }
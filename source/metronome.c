@@ -1,4 +1,8 @@
 #include "metronome.h"
+#include "metronome-mix.h"
+#include "metronome-program.h"
+#include "metronome-status.h"
+#include "metronome-trace.h"
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -8,7 +12,13 @@
 #include <cJSON.h>
 
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
 
 #define min(a, b) ({ \
      __typeof__ (a) _a = (a); \
@@ -22,15 +32,33 @@
 
 #define clamp(a, b, c) min(max(a, b), c)
 
-#define SAMPLE_RATE (44100)
 #define FRAMES_PER_BUFFER (512)
 #define CLICK_ONE_FREQUENCY (1880.0)
 #define CLICK_FREQUENCY (880.0)
+#define CLICK_SAMPLES ((uint32_t)(0.02 * SAMPLE_RATE)) // 20ms click
 
 #define MIN_DENOMINATOR (2)
 #define MAX_DENOMINATOR (16)
 #define MIN_NOMINATOR (2)
-#define MAX_NOMINATOR (32)
+#define MAX_NOMINATOR (MAX_BEATS_PER_MEASURE)
+
+#define CLICK_ACCENT_FREQUENCY (1320.0)
+
+static const uint8_t accent_routes[ACCENT_COUNT] = {
+    [ACCENT_MUTE]     = VOICE_GHOST,
+    [ACCENT_GHOST]    = VOICE_GHOST,
+    [ACCENT_NORMAL]   = VOICE_BEAT,
+    [ACCENT_STRONG]   = VOICE_ACCENT,
+    [ACCENT_DOWNBEAT] = VOICE_DOWNBEAT,
+};
+
+static const struct { double frequency; float gain; } accent_voices[ACCENT_COUNT] = {
+    [ACCENT_MUTE]     = { CLICK_FREQUENCY,        0.f  },
+    [ACCENT_GHOST]    = { CLICK_FREQUENCY,        .15f },
+    [ACCENT_NORMAL]   = { CLICK_FREQUENCY,        .5f  },
+    [ACCENT_STRONG]   = { CLICK_ACCENT_FREQUENCY, .5f  },
+    [ACCENT_DOWNBEAT] = { CLICK_ONE_FREQUENCY,    .5f  },
+};
 
 unsigned int power_of_two(unsigned int value) {
     if(value == 0) return 1;
@@ -52,374 +80,1773 @@ unsigned int power_of_two(unsigned int value) {
     return upper;
 }
 
+// Resolves the accent levels into the per-beat voice table the callback
+// plays from, so it never has to work out what a beat should sound like.
+static void compile_measure(struct Measure *measure, const uint8_t count_in) {
+    for(uint8_t i=0; i<MAX_BEATS_PER_MEASURE; ++i) {
+        uint8_t level = min(measure->accents[i], (uint8_t)(ACCENT_COUNT-1));
+        if(level == ACCENT_AUTO) {
+            level = (count_in || i == 0) ? ACCENT_DOWNBEAT : ACCENT_NORMAL;
+        }
+        measure->clicks[i].phase_step = 2.0 * M_PI * accent_voices[level].frequency / SAMPLE_RATE;
+        measure->clicks[i].gain       = accent_voices[level].gain;
+        measure->clicks[i].voice      = count_in ? VOICE_COUNT_IN : accent_routes[level];
+    }
+}
+static void measure_init(struct Measure *measure, const uint8_t beats, const uint8_t unit) {
+    measure->beats = beats;
+    measure->unit  = unit;
+    memset(measure->accents, ACCENT_AUTO, sizeof(measure->accents));
+    compile_measure(measure, 0x0);
+}
+
+// The callback moves bpm and the measure played, the UI sets them too,
+// so neither side reads or writes them plainly.
+static bpm_t load_bpm(const struct Metronome *m) {
+    return __atomic_load_n(&m->bpm, __ATOMIC_RELAXED);
+}
+static void store_bpm(struct Metronome *m, const bpm_t bpm) {
+    __atomic_store_n(&m->bpm, bpm, __ATOMIC_RELAXED);
+}
+static uint8_t load_active(const struct Track *t) {
+    return __atomic_load_n(&t->active_measure, __ATOMIC_RELAXED);
+}
+static void store_active(struct Track *t, const uint8_t active) {
+    __atomic_store_n(&t->active_measure, active, __ATOMIC_RELAXED);
+}
+
+static struct TrackMeasure *share_measure(const struct Measure *measure) {
+    struct TrackMeasure *node = malloc(sizeof(*node));
+    if(node) {
+        node->refs = 1;
+        node->measure = *measure;
+    }
+    return node;
+}
+static void release_measure(struct TrackMeasure *node) {
+    if(__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0) { free(node); }
+}
+void metronome_track_release(struct TrackVersion *v) {
+    if(v == NULL || __atomic_sub_fetch(&v->refs, 1, __ATOMIC_ACQ_REL) != 0) { return; }
+    for(uint8_t i=0; i<=v->measure_count; ++i) {
+        release_measure(v->measures[i]);
+    }
+    free(v);
+}
+
+// A version with every measure of the UI's track made anew, for a load or
+// when an edit could not be published on top of the last version.
+static struct TrackVersion *build_version(const struct Track *t, const uint8_t measure_count) {
+    struct TrackVersion *v = malloc(sizeof(*v));
+    if(v == NULL) { return NULL; }
+    for(uint8_t i=0; i<=measure_count; ++i) {
+        v->measures[i] = share_measure(&t->measures[i]);
+        if(v->measures[i] == NULL) {
+            while(i-- > 0) { release_measure(v->measures[i]); }
+            free(v);
+            return NULL;
+        }
+    }
+    v->refs = 1;
+    v->edited = load_active(t);
+    return v;
+}
+// A version sharing every measure of from, for an edit to change.
+static struct TrackVersion *copy_version(const struct TrackVersion *from) {
+    struct TrackVersion *v = malloc(sizeof(*v));
+    if(v == NULL) { return NULL; }
+    *v = *from;
+    v->refs = 1;
+    for(uint8_t i=0; i<=v->measure_count; ++i) {
+        __atomic_add_fetch(&v->measures[i]->refs, 1, __ATOMIC_RELAXED);
+    }
+    return v;
+}
+
+// Frees the versions given up that the callback has moved off. Whatever
+// was rendering when they were given up is waited out first, it may have
+// read one of them from published and be about to play it.
+static void reclaim_versions(struct Metronome *m) {
+    if(m->retired_count == 0) { return; }
+    metronome_wait_render(m);
+    const struct TrackVersion *playing = __atomic_load_n(&m->playing, __ATOMIC_ACQUIRE);
+
+    uint8_t kept = 0;
+    for(uint8_t i=0; i<m->retired_count; ++i) {
+        if(m->retired[i] == playing && kept == 0) {
+            m->retired[kept++] = m->retired[i];
+        } else {
+            metronome_track_release(m->retired[i]);
+        }
+    }
+    m->retired_count = kept;
+}
+// Hands v and the caller's reference to it to the callback. Call with
+// track_lock held.
+static void publish_version(struct Metronome *m, struct TrackVersion *v) {
+    struct TrackVersion *old = m->published;
+    // one taken up between beats is not queued, even while stopped and
+    // nothing takes it up
+    __atomic_store_n(&m->published_waits, v->quantize != QUANTIZE_NOW, __ATOMIC_RELAXED);
+    // ordered against the callback bumping rendering, as wait_render needs
+    __atomic_store_n(&m->published, v, __ATOMIC_SEQ_CST);
+    if(old) { m->retired[m->retired_count++] = old; }
+    reclaim_versions(m);
+}
+
+enum TrackEdit { TRACK_MEASURE, TRACK_INSERT, TRACK_REMOVE, TRACK_LAYOUT, TRACK_ALL };
+
+// Publishes an edit the UI has just made to its track at measure i. Only
+// an edited or inserted measure is copied, the rest is shared with the
+// version before. quantize and lands_on say where the callback takes it up.
+static void publish_edit(struct Metronome *m, const enum TrackEdit edit, const uint8_t i, const uint8_t quantize, const uint8_t lands_on) {
+    const struct Track *t = &m->track;
+    pthread_mutex_lock(&m->track_lock);
+
+    // read once, the version must hold exactly the measures it counts
+    // even with another thread editing the track under it
+    const uint8_t measure_count = t->measure_count;
+    const uint8_t loop_to = min(t->loop_to, measure_count);
+
+    // the callback moves active_measure as well, an edit that went to
+    // another measure than i left the track not one step from the version
+    // before and is published whole
+    const struct TrackVersion *from = m->published;
+    const int steps = (edit == TRACK_INSERT) ? 1 : (edit == TRACK_REMOVE) ? -1 : 0;
+    const uint8_t follows = from && !m->track_stale
+        && measure_count == from->measure_count + steps
+        && i <= from->measure_count + (edit == TRACK_INSERT)
+    ;
+    struct TrackVersion *v = (edit != TRACK_ALL && follows) ? copy_version(from) : NULL;
+    if(v) {
+        struct TrackMeasure *node = NULL;
+        if(edit == TRACK_MEASURE || edit == TRACK_INSERT) {
+            node = share_measure(&t->measures[i]);
+            if(node == NULL) {
+                metronome_track_release(v);
+                v = NULL;
+            }
+        }
+        if(v && edit == TRACK_MEASURE) {
+            release_measure(v->measures[i]);
+            v->measures[i] = node;
+        } else if(v && edit == TRACK_INSERT) {
+            memmove(&v->measures[i+1], &v->measures[i], (from->measure_count - i + 1) * sizeof(v->measures[0]));
+            v->measures[i] = node;
+        } else if(v && edit == TRACK_REMOVE) {
+            release_measure(v->measures[i]);
+            memmove(&v->measures[i], &v->measures[i+1], (from->measure_count - i) * sizeof(v->measures[0]));
+        }
+    }
+    if(v == NULL) {
+        v = build_version(t, measure_count);
+    }
+    if(v) {
+        v->measure_count = measure_count;
+        v->looping   = t->looping;
+        v->loop_from = min(t->loop_from, loop_to);
+        v->loop_to   = loop_to;
+        v->edited    = i;
+        v->quantize  = quantize;
+        v->lands_on  = lands_on;
+        publish_version(m, v);
+    }
+    // out of memory, the callback plays on from the version before
+    m->track_stale = (v == NULL);
+    pthread_mutex_unlock(&m->track_lock);
+}
+static void publish_now(struct Metronome *m, const enum TrackEdit edit, const uint8_t i) {
+    publish_edit(m, edit, i, QUANTIZE_NOW, 0);
+}
+
+// The version published now with a reference for the caller, NULL if
+// none could be.
+struct TrackVersion *metronome_track_retain(struct Metronome *m) {
+    pthread_mutex_lock(&m->track_lock);
+    struct TrackVersion *v = m->published;
+    if(v) { __atomic_add_fetch(&v->refs, 1, __ATOMIC_RELAXED); }
+    pthread_mutex_unlock(&m->track_lock);
+    return v;
+}
+// Publishes v again and brings the UI's track back to it, copying only
+// the measures it does not share with the version published before. A
+// version that waited for a beat or bar line is published as a copy that
+// does not. Returns what was published, with a reference for the caller.
+struct TrackVersion *metronome_track_restore(struct Metronome *m, struct TrackVersion *v) {
+    struct Track *t = &m->track;
+    pthread_mutex_lock(&m->track_lock);
+    const struct TrackVersion *from = m->published;
+    for(uint8_t i=0; i<=v->measure_count; ++i) {
+        if(from == NULL || m->track_stale || i > from->measure_count || v->measures[i] != from->measures[i]) {
+            t->measures[i] = v->measures[i]->measure;
+        }
+    }
+    t->measure_count = v->measure_count;
+    t->looping       = v->looping;
+    t->loop_from     = v->loop_from;
+    t->loop_to       = v->loop_to;
+    t->revision++;
+
+    struct TrackVersion *published = v;
+    if(v->quantize != QUANTIZE_NOW) {
+        published = copy_version(v);
+        if(published) { published->quantize = QUANTIZE_NOW; }
+    } else {
+        __atomic_add_fetch(&v->refs, 1, __ATOMIC_RELAXED);
+    }
+    if(published) {
+        // one reference for published, one for the caller
+        __atomic_add_fetch(&published->refs, 1, __ATOMIC_RELAXED);
+        publish_version(m, published);
+        m->track_stale = 0x0;
+    } else {
+        m->track_stale = 0x1;
+    }
+    pthread_mutex_unlock(&m->track_lock);
+    return published;
+}
+// Call once nothing renders the session any more.
+void metronome_track_free(struct Metronome *m) {
+    pthread_mutex_lock(&m->track_lock);
+    for(uint8_t i=0; i<m->retired_count; ++i) {
+        metronome_track_release(m->retired[i]);
+    }
+    m->retired_count = 0;
+    metronome_track_release(m->published);
+    m->published = NULL;
+    m->playing = NULL;
+    pthread_mutex_unlock(&m->track_lock);
+    pthread_mutex_destroy(&m->track_lock);
+}
+
+void metronome_set_accent(struct Metronome *m, const uint8_t beat, const uint8_t level) {
+    const uint8_t at = load_active(&m->track);
+    struct Measure *measure = &m->track.measures[at];
+    if(beat >= measure->beats || level >= ACCENT_COUNT) { return; }
+
+    measure->accents[beat] = level;
+    compile_measure(measure, 0x0);
+    publish_now(m, TRACK_MEASURE, at);
+}
+// Hands the UI's routing to the callback in the copy it is not mixing
+// with. The copy given up is rebuilt by the next change, so whatever may
+// still be mixing with it is waited out first.
+static void publish_routing(struct Metronome *m) {
+    pthread_mutex_lock(&m->track_lock);
+    const uint8_t next = !m->route_live;
+    m->routes[next] = m->routing;
+    // ordered against the callback bumping rendering, as wait_render needs
+    __atomic_store_n(&m->route_live, next, __ATOMIC_SEQ_CST);
+    metronome_wait_render(m);
+    pthread_mutex_unlock(&m->track_lock);
+}
+// Sets the gains of one voice to its first channels outputs and leaves it
+// out of the rest, widening the routing if it had fewer.
+void metronome_set_route(struct Metronome *m, const uint8_t voice, const float *gains, uint8_t channels) {
+    struct Routing *r = &m->routing;
+    if(voice >= VOICE_COUNT) { return; }
+    channels = min(channels, (uint8_t)MAX_ROUTE_CHANNELS);
+
+    memset(r->gains[voice], 0, sizeof(r->gains[voice]));
+    memcpy(r->gains[voice], gains, channels * sizeof(float));
+    r->channels = max(r->channels, channels);
+    metronome_routing_compile(r);
+    publish_routing(m);
+}
+int metronome_set_grouping(struct Metronome *m, const char *grouping) {
+    uint8_t accents[MAX_BEATS_PER_MEASURE];
+    unsigned int beats = 0;
+
+    while(*grouping) {
+        char *end;
+        const long group = strtol(grouping, &end, 10);
+        if(end == grouping || group < 1 || beats+group > MAX_NOMINATOR) { return -1; }
+
+        accents[beats] = (beats == 0) ? ACCENT_DOWNBEAT : ACCENT_STRONG;
+        memset(&accents[beats+1], ACCENT_NORMAL, group-1);
+        beats += group;
+
+        grouping = (*end == '+') ? end+1 : end;
+        if(*end != '+' && *end != '\0') { return -1; }
+    }
+    if(beats < MIN_NOMINATOR) { return -1; }
+
+    const uint8_t at = load_active(&m->track);
+    struct Measure *measure = &m->track.measures[at];
+    if(measure->beats != beats) {
+        measure->beats = beats;
+        m->track.revision++;
+    }
+    memcpy(measure->accents, accents, beats);
+    compile_measure(measure, 0x0);
+    publish_now(m, TRACK_MEASURE, at);
+    return 0;
+}
+
 void metronome_set_beats(struct Metronome *m, const int value) {
-    m->track.measures[m->track.active_measure].beats = clamp(value, MIN_NOMINATOR, MAX_NOMINATOR);
+    const uint8_t at = load_active(&m->track);
+    m->track.measures[at].beats = clamp(value, MIN_NOMINATOR, MAX_NOMINATOR);
+    m->track.revision++;
+    publish_now(m, TRACK_MEASURE, at);
 }
 void metronome_set_unit(struct Metronome *m, const int value) {
-    m->track.measures[m->track.active_measure].unit = clamp(power_of_two(value), MIN_DENOMINATOR, MAX_DENOMINATOR);
+    const uint8_t at = load_active(&m->track);
+    m->track.measures[at].unit = clamp(power_of_two(value), MIN_DENOMINATOR, MAX_DENOMINATOR);
+    m->track.revision++;
+    publish_now(m, TRACK_MEASURE, at);
 }
 void metronome_inc_unit(struct Metronome *m) { 
-    uint8_t *unit = &m->track.measures[m->track.active_measure].unit;
+    const uint8_t at = load_active(&m->track);
+    uint8_t *unit = &m->track.measures[at].unit;
     *unit = min(*unit << 1, MAX_DENOMINATOR);
+    m->track.revision++;
+    publish_now(m, TRACK_MEASURE, at);
 }
 void metronome_dec_unit(struct Metronome *m) {
-    uint8_t *unit = &m->track.measures[m->track.active_measure].unit;
+    const uint8_t at = load_active(&m->track);
+    uint8_t *unit = &m->track.measures[at].unit;
     *unit = max(*unit >> 1, MIN_DENOMINATOR);
+    m->track.revision++;
+    publish_now(m, TRACK_MEASURE, at);
 }
 void metronome_inc_beats(struct Metronome *m) {
-    uint8_t *beats = &m->track.measures[m->track.active_measure].beats;
+    const uint8_t at = load_active(&m->track);
+    uint8_t *beats = &m->track.measures[at].beats;
     *beats = min(*beats+1, MAX_NOMINATOR);
+    m->track.revision++;
+    publish_now(m, TRACK_MEASURE, at);
 }
 void metronome_dec_beats(struct Metronome *m) {
-    uint8_t *beats = &m->track.measures[m->track.active_measure].beats;
+    const uint8_t at = load_active(&m->track);
+    uint8_t *beats = &m->track.measures[at].beats;
     *beats = max(*beats-1, MIN_NOMINATOR);
+    m->track.revision++;
+    publish_now(m, TRACK_MEASURE, at);
 }
 
-void data_callback(ma_device* device, void* output, const void* input, ma_uint32 frame_count) {
-    float *out = (float*)output;
-    (void)input;
-    (void)device;
-    struct Metronome *m = device->pUserData;
-    if(m->state==METRONOME_STOPPED) { return; }
+void metronome_set_bpm(struct Metronome *m, const double value) {
+    store_bpm(m, BPM(clamp(value, BPM_FLOAT(MIN_BPM), BPM_FLOAT(MAX_BPM))));
+}
+void metronome_inc_bpm(struct Metronome *m) {
+    store_bpm(m, min(load_bpm(m) + BPM(1), MAX_BPM));
+}
+void metronome_dec_bpm(struct Metronome *m) {
+    const bpm_t bpm = load_bpm(m);
+    store_bpm(m, (bpm > MIN_BPM + BPM(1)) ? bpm - BPM(1) : MIN_BPM);
+}
+
+uint32_t metronome_practice_length(const struct Practice *p) {
+    if(p->program != PROGRAM_NONE) { return p->bars; }
+    const bpm_t span = (p->bpm_to > p->bpm_from) ? p->bpm_to - p->bpm_from : p->bpm_from - p->bpm_to;
+    const uint32_t steps = (p->bpm_step > 0) ? (span + p->bpm_step - 1) / p->bpm_step : 1;
+    return max(steps, 1u) * max(p->interval, 1);
+}
+
+static double practice_tempo(const struct Practice *p, double u) {
+    const double from = BPM_FLOAT(p->bpm_from);
+    const double to   = BPM_FLOAT(p->bpm_to);
+    u = clamp(u, 0.0, 1.0);
+
+    if(p->curve == PRACTICE_EXPONENTIAL) {
+        return from * pow(to/from, u);
+    }
+    return from + (to-from)*u;
+}
+
+// Exact length in samples of a beat whose tempo moves from t0 to t1.
+// The mean of 1/tempo over the beat has a closed form for both curves,
+// so a ramp costs a log per beat and nothing per sample.
+static double beat_length(const double t0, const double t1, const uint8_t curve, const uint8_t unit) {
+    double inv_tempo = 1.0/t0;
+    if(fabs(t1-t0) > 1e-9) {
+        const double log_ratio = log(t1/t0);
+        inv_tempo = (curve == PRACTICE_EXPONENTIAL)
+            ? (1.0/t0 - 1.0/t1) / log_ratio
+            : log_ratio / (t1-t0);
+    }
+    return 60.0 * (4.0/unit) * SAMPLE_RATE * inv_tempo;
+}
+
+static uint8_t loop_first(const struct TrackVersion *t) { return t->looping ? t->loop_from : 0; }
+static uint8_t loop_last(const struct TrackVersion *t)  { return t->looping ? t->loop_to : t->measure_count; }
+
+static uint8_t next_measure(const struct TrackVersion *t, const uint8_t active) {
+    const uint8_t first = loop_first(t);
+    return (active >= first && active < loop_last(t)) ? active+1 : first;
+}
+
+// Position of a beat within a continuous practice ramp, 0 at the first
+// beat and 1 once every loop of the track has been played.
+static double ramp_position(const struct Metronome *m, const struct Practice *p, const unsigned int beat, const uint8_t beats) {
+    const double measures = loop_last(m->playing) - loop_first(m->playing) + 1;
+    const double bar = p->iteration*measures + (load_active(&m->track) - loop_first(m->playing)) + (double)beat/beats;
+    return bar / (metronome_practice_length(p) * measures);
+}
+
+static int practice_ramping(const struct Metronome *m) {
+    const struct Practice *p = &m->practice[m->practice_current];
+    return m->practice_active && p->program == PROGRAM_NONE && p->curve != PRACTICE_STEP && p->stage == PRACTICE_RAMP;
+}
+
+// Steps towards bpm_to and reports whether it has been reached
+static int practice_step(struct Metronome *m, const struct Practice *p) {
+    const bpm_t bpm = load_bpm(m);
+    if(p->bpm_to >= p->bpm_from) {
+        store_bpm(m, min(bpm + p->bpm_step, p->bpm_to));
+        return load_bpm(m) >= p->bpm_to;
+    }
+    store_bpm(m, (bpm > p->bpm_to + p->bpm_step) ? bpm - p->bpm_step : p->bpm_to);
+    return load_bpm(m) <= p->bpm_to;
+}
+
+static void program_play(struct Metronome *m, const struct Practice *p) {
+    const struct ProgramBar bar = metronome_program_bar(p, p->iteration);
+    store_bpm(m, bar.bpm);
+    m->practice_silent = bar.silent;
+}
+
+static void practice_enter(struct Metronome *m, const uint8_t set) {
+    struct Practice *p = &m->practice[set];
+    m->practice_current = set;
+    p->stage = PRACTICE_RAMP;
+    p->iteration = 0;
+    store_bpm(m, p->bpm_from);
+    m->practice_silent = 0x0;
+    if(p->program != PROGRAM_NONE) { program_play(m, p); }
+}
+
+// On to the next set, 0 when that was the last and the program is over
+static int practice_next(struct Metronome *m) {
+    if(m->practice_current+1 >= m->practice_count) {
+        m->practice_active = 0x0;
+        m->practice_silent = 0x0;
+        if(m->practice_autostop) {
+            __atomic_store_n(&m->state, METRONOME_STOPPED, __ATOMIC_RELAXED);
+        }
+        return 0;
+    }
+    practice_enter(m, m->practice_current+1);
+    return 1;
+}
+
+// Runs the practice program on every bar line, in the audio timeline.
+// Stages of zero length fall straight through to the next one.
+static void practice_update(struct Metronome *m, const uint8_t wrapped) {
+    struct Practice *p = &m->practice[m->practice_current];
+    if(wrapped || p->program != PROGRAM_NONE) {
+        p->iteration++;
+    }
+
+    for(;;) {
+        if(p->program != PROGRAM_NONE) {
+            if(p->bars == 0 || p->iteration < p->bars) {
+                program_play(m, p);
+                return;
+            }
+            if(!practice_next(m)) { return; }
+            p = &m->practice[m->practice_current];
+            if(p->program != PROGRAM_NONE || p->curve != PRACTICE_STEP) { return; }
+        }
+        if(p->stage == PRACTICE_RAMP) {
+            int reached = 0;
+            if(p->curve == PRACTICE_STEP) {
+                if(p->iteration >= (p->interval ? p->interval : 1)) {
+                    reached = practice_step(m, p);
+                    p->iteration = 0;
+                }
+            } else {
+                reached = p->iteration >= metronome_practice_length(p);
+            }
+            if(!reached) { return; }
+
+            store_bpm(m, p->bpm_to);
+            p->stage = PRACTICE_PLATEAU;
+            p->iteration = 0;
+        }
+        if(p->stage == PRACTICE_PLATEAU) {
+            if(p->iteration < p->plateau) { return; }
+
+            p->stage = PRACTICE_REBOUND;
+            p->iteration = 0;
+            if(p->rebound > 0) {
+                store_bpm(m, (p->bpm_to > MIN_BPM + p->rebound) ? p->bpm_to - p->rebound : MIN_BPM);
+                return;
+            }
+        }
+        if(p->stage == PRACTICE_REBOUND) {
+            if(p->rebound > 0 && p->iteration < max(p->interval, 1)) { return; }
+
+            if(!practice_next(m)) { return; }
+            p = &m->practice[m->practice_current];
+            if(p->program != PROGRAM_NONE || p->curve != PRACTICE_STEP) { return; }
+        }
+    }
+}
+
+static double next_beat_length(struct Metronome *m, const unsigned int beat, const uint8_t beats, const uint8_t unit) {
+    const struct Practice *p = &m->practice[m->practice_current];
+    if(practice_ramping(m) && m->state==METRONOME_RUNNING) {
+        const double t0 = practice_tempo(p, ramp_position(m, p, beat, beats));
+        const double t1 = practice_tempo(p, ramp_position(m, p, beat+1, beats));
+        store_bpm(m, BPM(t0));
+        return beat_length(t0, t1, p->curve, unit);
+    }
+    const double bpm = BPM_FLOAT(load_bpm(m));
+    return beat_length(bpm, bpm, PRACTICE_STEP, unit);
+}
+
+// Picks up a posted phase correction at the next beat, or the next bar
+// line, and hands out its share for the beat that starts at frame.
+static void sync_advance(struct Metronome *m, const uint64_t frame) {
+    struct Engine *e = &m->engine;
+    struct Sync *s = &m->sync;
+
+    if(e->sync_gap != 0.0 && e->sync_beats == 0) {
+        __atomic_store_n(&s->settled_frame, frame, __ATOMIC_RELEASE);
+    }
+    e->sync_gap = 0.0;
+    if(e->sync_beats == 0 && __atomic_load_n(&s->pending, __ATOMIC_ACQUIRE) && (!s->bar || e->beat_counter == 0)) {
+        e->sync_beats = max(s->beats, (uint8_t)1);
+        e->sync_step  = s->adjust / e->sync_beats;
+        __atomic_store_n(&s->pending, 0x0, __ATOMIC_RELEASE);
+    }
+    if(e->sync_beats > 0) {
+        e->sync_gap = e->sync_step;
+        e->sync_beats--;
+    }
+}
+
+// Slots are copied field by field, a reader may be copying the one being
+// written and throws the copy away once it sees that.
+static void copy_event(struct BeatEvent *to, const struct BeatEvent *from) {
+    __atomic_store_n(&to->frame,    __atomic_load_n(&from->frame, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&to->bpm,      __atomic_load_n(&from->bpm, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&to->measure,  __atomic_load_n(&from->measure, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&to->beat,     __atomic_load_n(&from->beat, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&to->count_in, __atomic_load_n(&from->count_in, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&to->silent,   __atomic_load_n(&from->silent, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+static void publish_beat(struct Metronome *m, const uint64_t frame) {
+    const uint32_t head = m->beat_head;
+    const struct BeatEvent event = {
+        .frame    = frame,
+        .bpm      = load_bpm(m),
+        .measure  = load_active(&m->track),
+        .beat     = m->engine.beat_counter,
+        .count_in = (m->state==METRONOME_STARTED),
+        .silent   = (m->practice_silent && m->practice_active),
+    };
+    __atomic_store_n(&m->beat_writing, head+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    copy_event(&m->beat_events[head % BEAT_EVENTS], &event);
+    __atomic_store_n(&m->beat_head, head+1, __ATOMIC_RELEASE);
+    metronome_trace_instant("audio", event.beat == 0 ? "downbeat" : "beat");
+}
+
+// Applies the queued tempo changes whose beat or bar line has come around,
+// in order, so a change waiting for the bar holds back those behind it.
+static void apply_changes(struct Metronome *m, const uint8_t bar_line) {
+    struct ChangeQueue *q = &m->changes;
+    for(;;) {
+        struct Change *c = &q->slots[q->tail % CHANGE_QUEUE];
+        if(__atomic_load_n(&c->sequence, __ATOMIC_ACQUIRE) != q->tail+1) { break; }
+        if(c->quantize == QUANTIZE_BAR && !bar_line) { break; }
+
+        store_bpm(m, c->bpm);
+        __atomic_store_n(&c->sequence, q->tail + CHANGE_QUEUE, __ATOMIC_RELEASE);
+        __atomic_store_n(&q->tail, q->tail+1, __ATOMIC_RELEASE);
+    }
+}
+
+// Takes up the version of the track published last once the boundary it
+// waits for has come around, boundary being how far the callback is: only
+// QUANTIZE_NOW versions between beats. The UI moves active_measure along
+// with its own track, which can be ahead of the version played, so it is
+// read once into active and kept within the version. Returns the version
+// to play.
+static const struct TrackVersion *adopt_track(struct Metronome *m, const uint8_t boundary, uint8_t *active) {
+    const struct TrackVersion *t = m->playing;
+    const struct TrackVersion *next = __atomic_load_n(&m->published, __ATOMIC_SEQ_CST);
+    *active = load_active(&m->track);
+    if(next != t && next->quantize <= boundary && (next->quantize == QUANTIZE_NOW || next->lands_on == *active)) {
+        t = next;
+        __atomic_store_n(&m->playing, t, __ATOMIC_RELEASE);
+    }
+    if(*active > t->measure_count) {
+        *active = t->measure_count;
+        store_active(&m->track, *active);
+    }
+    return t;
+}
+
+// Adds the clicks of one session into its routed channels from channel on
+// of an interleaved buffer that the caller has already silenced. Stretches
+// between clicks are skipped in one step, so a silent session costs next
+// to nothing and many of them can share one device callback.
+void metronome_render(struct Metronome *m, float *out, const uint32_t frame_count, const uint32_t channels) {
+    if(m->state==METRONOME_STOPPED || m->playing == NULL) { return; }
 
-    static double phase = 0.0;
-    static unsigned int beat_sample_counter = 0;
-    static unsigned int beat_counter = 0;
-    static const unsigned int click_samples = (unsigned int)(0.02 * SAMPLE_RATE); // 20ms click
+    struct Engine *e = &m->engine;
+    out += m->channel;
+    const uint8_t outputs = (channels > m->channel) ? min(channels - m->channel, (uint32_t)MAX_ROUTE_CHANNELS) : 0;
+    float voice[CLICK_SAMPLES];
 
     // @todo: remove this and instead set these values in metronome_stop()
     if (m->reset == 0x1) {
-        phase = 0.0;
-        beat_sample_counter = 0;
-        beat_counter = 0;
+        memset(e, 0, sizeof(*e));
         m->reset = 0x0;
     }
+    uint8_t active;
+    const struct TrackVersion *t = adopt_track(m, QUANTIZE_NOW, &active);
+    const struct Routing *routing = &m->routes[__atomic_load_n(&m->route_live, __ATOMIC_SEQ_CST)];
+    if (__atomic_exchange_n(&m->seek, 0x0, __ATOMIC_ACQUIRE)) {
+        struct Position to;
+        __atomic_load(&m->seek_to, &to, __ATOMIC_RELAXED);
+        active = min(to.measure, t->measure_count);
+        store_active(&m->track, active);
+        if(m->state==METRONOME_RUNNING) {
+            // the UI's track may be ahead of this version, the beat is
+            // only checked here
+            e->beat_counter = min(to.beat, (uint8_t)(t->measures[active]->measure.beats-1));
+            e->beat_sample_counter = to.offset;
+            m->tick = e->beat_counter+1;
+        }
+        e->phase = 0.0;
+        e->beat_samples = 0.0;
+        e->beat_carry = 0.0;
+    }
 
     uint8_t beats = 0;
     uint8_t unit  = 0;
     if(m->state==METRONOME_STARTED) {
         unit  = m->count_in.unit;
         beats = m->count_in.beats;
-        if(unit==0 || beats==0) { m->state = METRONOME_RUNNING; }
+        if(unit==0 || beats==0) { __atomic_store_n(&m->state, METRONOME_RUNNING, __ATOMIC_RELAXED); }
     }
     if(m->state==METRONOME_RUNNING) {
-        unit    = m->track.measures[m->track.active_measure].unit;
-        beats   = m->track.measures[m->track.active_measure].beats;
-    }
-
-    const double beat_duration = (60.0/m->bpm) * (4.0/unit);
-    const unsigned int beat_samples = (unsigned int)(beat_duration * SAMPLE_RATE);
-                                                                                  
-    for(ma_uint32 i=0; i<frame_count; ++i) {
-        if(beat_sample_counter < click_samples) {
-            float amplitude = sin(phase) * .5f;
-            *out++ = amplitude;
-            *out++ = amplitude; // for sterio output
-            phase += 2.0 * M_PI * (m->state==METRONOME_STARTED || beat_counter==0 ? CLICK_ONE_FREQUENCY : CLICK_FREQUENCY) / SAMPLE_RATE;
-        } else {
-            *out++ = 0.f;
-            *out++ = 0.f;
+        unit    = t->measures[active]->measure.unit;
+        beats   = t->measures[active]->measure.beats;
+    }
+    const struct Measure *measure = (m->state==METRONOME_STARTED) ? &m->count_in : &t->measures[active]->measure;
+    const struct Click *click = &measure->clicks[e->beat_counter];
+
+    if(e->frames == 0 && e->beat_sample_counter == 0 && m->state!=METRONOME_STOPPED) {
+        publish_beat(m, 0);
+    }
+
+    // the sync thread trims the rate between periods, it holds for this one
+    double ratio;
+    __atomic_load(&m->sync.ratio, &ratio, __ATOMIC_RELAXED);
+
+    // a fixed tempo follows m->bpm straight away, a ramp is only ever
+    // evaluated at beat boundaries
+    if(!practice_ramping(m) || m->state==METRONOME_STARTED || e->beat_samples == 0.0) {
+        e->beat_samples = next_beat_length(m, e->beat_counter, beats, unit) * ratio + e->sync_gap;
+    }
+    uint32_t beat_end = (uint32_t)(e->beat_samples + e->beat_carry);
+
+    uint32_t i = 0;
+    while(i < frame_count) {
+        // a beat always advances by at least a sample, even when a tempo
+        // change has already moved its end behind us
+        uint32_t span = (beat_end > e->beat_sample_counter) ? beat_end - e->beat_sample_counter : 1;
+        span = min(span, frame_count - i);
+
+        if(e->beat_sample_counter < CLICK_SAMPLES && !(m->practice_silent && m->practice_active)) {
+            span = min(span, CLICK_SAMPLES - e->beat_sample_counter);
+            for(uint32_t k=0; k<span; ++k) {
+                voice[k] = sin(e->phase) * click->gain;
+                e->phase += click->phase_step;
+            }
+            metronome_mix(routing, click->voice, &out[i*channels], channels, outputs, voice, span);
         }
+        e->beat_sample_counter += span;
+        i += span;
 
-        beat_sample_counter++;
+        if(e->beat_sample_counter >= beat_end) {
+            e->beat_carry += e->beat_samples - beat_end;
+            e->beat_sample_counter = 0;
+            e->phase = 0.0;
 
-        if(beat_sample_counter >= beat_samples) {
             if(m->state==METRONOME_STARTED) {
-                beat_counter++;
-                if(beat_counter > m->count_in.beats) {
-                    m->state = METRONOME_RUNNING;
+                if(++e->beat_counter >= beats) {
+                    __atomic_store_n(&m->state, METRONOME_RUNNING, __ATOMIC_RELAXED);
+                    e->beat_counter = 0;
+                    t = adopt_track(m, QUANTIZE_BAR, &active);
+                    measure = &t->measures[active]->measure;
+                    unit  = measure->unit;
+                    beats = measure->beats;
+                    e->bar_frame = e->frames + i;
                 }
+                publish_beat(m, e->frames + i);
             } else {
-                beat_sample_counter = 0;
-                phase = 0.0;
-                beat_counter = (beat_counter +1) % beats;
+                if(++e->beat_counter >= beats) {
+                    e->beat_counter = 0;
+                }
 
-                if(beat_counter == 0) {
-                    m->track.active_measure = m->track.active_measure < m->track.measure_count ? m->track.active_measure+1 : 0;
+                uint8_t wrapped = 0x0;
+                if(e->beat_counter == 0) {
+                    const uint8_t next = next_measure(t, active);
+                    wrapped = (next <= active);
+                    store_active(&m->track, next);
+                    e->bar_frame = e->frames + i;
                 }
-                
-                m->tick = beat_counter+1;
 
-                if (beat_counter == 0 && m->practice_active) {
-                    struct Practice *p = &m->practice[m->practice_current];
-                    if (m->track.active_measure == 0) {
-                        p->iteration++;
-                    }
+                apply_changes(m, e->beat_counter == 0);
+                t = adopt_track(m, (e->beat_counter == 0) ? QUANTIZE_BAR : QUANTIZE_BEAT, &active);
+                measure = &t->measures[active]->measure;
+                unit  = measure->unit;
+                beats = measure->beats;
+                m->tick = e->beat_counter+1;
 
-                    if(p->iteration > p->interval-1) {
-                        m->bpm += p->bpm_step;
-                        p->iteration = 0;
+                if (e->beat_counter == 0 && m->practice_active) {
+                    practice_update(m, wrapped);
+                    if(m->state==METRONOME_STOPPED) {
+                        // program finished, the rest of the buffer stays silent
+                        e->frames += frame_count;
+                        return;
                     }
                 }
+                publish_beat(m, e->frames + i);
             }
+
+            if(m->state==METRONOME_RUNNING) { sync_advance(m, e->frames + i); }
+            e->beat_samples = next_beat_length(m, e->beat_counter, beats, unit) * ratio + e->sync_gap;
+            beat_end = (uint32_t)(e->beat_samples + e->beat_carry);
+            click = &measure->clicks[e->beat_counter];
         }
     }
+    e->frames += frame_count;
 }
-void metronome_save(const struct Metronome *m, const char *path) {
-    char path_buffer[128];
+
+#define REALTIME_PRIORITY   (70)
+#define PREFAULT_STACK      (64*1024)
+
+// Runs once on the callback thread. Faults in the stack the callback
+// can grow into, then asks for SCHED_FIFO, falling back to whatever
+// RLIMIT_RTPRIO allows an unprivileged user.
+static uint8_t realtime_thread(void) {
+    volatile uint8_t stack[PREFAULT_STACK];
+    for(size_t i=0; i<sizeof(stack); i+=4096) { stack[i] = 0; }
+
+    int policy;
+    struct sched_param param;
+    if(pthread_getschedparam(pthread_self(), &policy, &param) == 0 && (policy == SCHED_FIFO || policy == SCHED_RR)) {
+        // the backend, JACK for one, already runs us real-time
+        return REALTIME_SCHEDULING;
+    }
+
+    param.sched_priority = min(REALTIME_PRIORITY, sched_get_priority_max(SCHED_FIFO));
+    if(pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0) {
+        return REALTIME_SCHEDULING;
+    }
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_RTPRIO, &limit) == 0 && limit.rlim_cur > 0) {
+        param.sched_priority = min((int)limit.rlim_cur, param.sched_priority);
+        if(pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0) {
+            return REALTIME_SCHEDULING;
+        }
+    }
+    return 0;
+}
+
+// Touches every page of the session and the voice table so the first
+// callback after a start never waits on a page fault. An atomic add of
+// zero dirties a page without racing whoever else writes to it.
+static void prefault(struct Metronome *m) {
+    const long page = sysconf(_SC_PAGESIZE);
+    uint8_t *bytes = (uint8_t*)m;
+    for(size_t i=0; i<sizeof(*m); i+=page) {
+        __atomic_fetch_add(&bytes[i], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&bytes[sizeof(*m)-1], 0, __ATOMIC_RELAXED);
+
+    volatile double sink = 0.0;
+    for(int i=0; i<ACCENT_COUNT; ++i) {
+        sink += accent_voices[i].frequency;
+    }
+    (void)sink;
+}
+
+static void publish_clock(struct Metronome *m, const int64_t ns, const uint32_t frame_count) {
+    const uint32_t sequence = m->clock_sequence;
+    __atomic_store_n(&m->clock_sequence, sequence+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    m->clock_ns    = ns;
+    m->clock_frame = m->engine.frames - frame_count;
+
+    __atomic_store_n(&m->clock_sequence, sequence+2, __ATOMIC_RELEASE);
+}
+
+// miniaudio hands us a silenced buffer, noPreSilencedOutputBuffer is left off
+void data_callback(ma_device* device, void* output, const void* input, ma_uint32 frame_count) {
+    (void)input;
+    struct Metronome *m = device->pUserData;
+    const int64_t begin_ns = metronome_trace_begin();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(m->realtime && !m->realtime_tried) {
+        __atomic_fetch_or(&m->realtime_granted, realtime_thread(), __ATOMIC_RELEASE);
+        m->realtime_tried = 0x1;
+    }
+    __atomic_add_fetch(&m->rendering, 1, __ATOMIC_SEQ_CST);
+    metronome_render(m, (float*)output, frame_count, device->playback.channels);
+    publish_clock(m, (int64_t)now.tv_sec * 1000000000 + now.tv_nsec, frame_count);
+    metronome_status_publish(m);
+    __atomic_add_fetch(&m->rendering, 1, __ATOMIC_RELEASE);
+    metronome_trace_span("audio", "callback", begin_ns);
+}
+
+static void host_callback(ma_device* device, void* output, const void* input, ma_uint32 frame_count) {
+    (void)input;
+    struct MetronomeHost *h = device->pUserData;
+    const int64_t begin_ns = metronome_trace_begin();
+    __atomic_add_fetch(&h->rendering, 1, __ATOMIC_SEQ_CST);
+    const uint8_t count = __atomic_load_n(&h->session_count, __ATOMIC_ACQUIRE);
+    for(uint8_t i=0; i<count; ++i) {
+        struct Metronome *m = __atomic_load_n(&h->sessions[i], __ATOMIC_ACQUIRE);
+        if(m == NULL) { continue; }
+        __atomic_add_fetch(&m->rendering, 1, __ATOMIC_SEQ_CST);
+        metronome_render(m, (float*)output, frame_count, h->channels);
+        metronome_status_publish(m);
+        __atomic_add_fetch(&m->rendering, 1, __ATOMIC_RELEASE);
+    }
+    __atomic_add_fetch(&h->rendering, 1, __ATOMIC_RELEASE);
+    metronome_trace_span("audio", "callback", begin_ns);
+}
+
+static void save_accents(cJSON *j_measure, const struct Measure *measure) {
+    cJSON *j_accents = cJSON_AddArrayToObject(j_measure, "accents");
+    for(uint8_t i=0; i<measure->beats && i<MAX_BEATS_PER_MEASURE; ++i) {
+        cJSON_AddItemToArray(j_accents, cJSON_CreateNumber(measure->accents[i]));
+    }
+}
+static void load_accents(const cJSON *j_measure, struct Measure *measure, const uint8_t count_in) {
+    memset(measure->accents, ACCENT_AUTO, sizeof(measure->accents));
+
+    const cJSON *j_accents = cJSON_GetObjectItemCaseSensitive(j_measure, "accents");
+    if(cJSON_IsArray(j_accents)) {
+        for(int i=0; i<cJSON_GetArraySize(j_accents) && i<MAX_BEATS_PER_MEASURE; ++i) {
+            const cJSON *level = cJSON_GetArrayItem(j_accents, i);
+            if(cJSON_IsNumber(level) && level->valueint >= 0 && level->valueint < ACCENT_COUNT) {
+                measure->accents[i] = level->valueint;
+            }
+        }
+    }
+    compile_measure(measure, count_in);
+}
+void metronome_session_path(const char *path, char *out, const size_t size) {
     if(path==NULL) {
-        sprintf(path_buffer, "%s/.local/share/metronome.save", getenv("HOME"));
+        snprintf(out, size, "%s/.local/share/metronome.save", getenv("HOME"));
     } else {
-        strcpy(path_buffer, path);
+        snprintf(out, size, "%s", path);
     }
-
-    FILE *f = fopen(path_buffer, "w");
+}
+// Copies out everything metronome_save() writes. The play position in
+// the track is left out so snapshots only differ on real edits.
+void metronome_snapshot(const struct Metronome *m, struct Session *s) {
+    s->bpm               = load_bpm(m);
+    s->base_bpm          = m->base_bpm;
+    s->count_in          = m->count_in;
+    s->practice_count    = m->practice_count;
+    s->practice_autostop = m->practice_autostop;
+    memcpy(s->practice, m->practice, sizeof(s->practice));
+    s->routing           = m->routing;
+    s->track                = m->track;
+    s->track.active_measure = 0;
+    s->track.selection      = 0;
+}
+static uint8_t same_saved_measure(const struct Measure *a, const struct Measure *b) {
+    return a->beats == b->beats && a->unit == b->unit
+        && memcmp(a->accents, b->accents, min(a->beats, MAX_BEATS_PER_MEASURE)) == 0;
+}
+// Which parts of the save file would differ, looking only at what
+// metronome_session_json() writes.
+uint8_t metronome_session_diff(const struct Session *a, const struct Session *b) {
+    uint8_t parts = 0;
+    if(a->bpm != b->bpm || a->base_bpm != b->base_bpm || !same_saved_measure(&a->count_in, &b->count_in)) {
+        parts |= SESSION_TEMPO;
+    }
+    if(a->track.measure_count != b->track.measure_count) {
+        parts |= SESSION_TRACK;
+    }
+    for(uint8_t i=0; !(parts & SESSION_TRACK) && i<=a->track.measure_count; ++i) {
+        if(!same_saved_measure(&a->track.measures[i], &b->track.measures[i])) { parts |= SESSION_TRACK; }
+    }
+    if(a->practice_count != b->practice_count || a->practice_autostop != b->practice_autostop) {
+        parts |= SESSION_PRACTICE;
+    }
+    for(uint8_t i=0; !(parts & SESSION_PRACTICE) && i<a->practice_count; ++i) {
+        const struct Practice *p = &a->practice[i];
+        const struct Practice *q = &b->practice[i];
+        if(p->bpm_from != q->bpm_from || p->bpm_to != q->bpm_to || p->bpm_step != q->bpm_step
+            || p->interval != q->interval || p->curve != q->curve || p->plateau != q->plateau || p->rebound != q->rebound
+            || p->program != q->program
+            || (p->program != PROGRAM_NONE && (p->seed != q->seed || p->bars != q->bars || p->dropout != q->dropout))
+        ) {
+            parts |= SESSION_PRACTICE;
+        }
+    }
+    if(a->routing.channels != b->routing.channels) {
+        parts |= SESSION_ROUTING;
+    }
+    for(uint8_t v=0; !(parts & SESSION_ROUTING) && v<VOICE_COUNT; ++v) {
+        if(memcmp(a->routing.gains[v], b->routing.gains[v], a->routing.channels * sizeof(float)) != 0) { parts |= SESSION_ROUTING; }
+    }
+    return parts;
+}
+// The save file, cJSON_Print() style or on a single line, with only the
+// given parts of it. Free the result.
+char *metronome_session_json(const struct Session *s, const uint8_t parts, const uint8_t pretty) {
     cJSON *json = cJSON_CreateObject();
     cJSON *j_metronome = cJSON_AddObjectToObject(json, "metronome");
-    { // base settings
-        cJSON_AddNumberToObject(j_metronome, "base_bpm", m->base_bpm);
-        cJSON_AddNumberToObject(j_metronome, "bpm", m->bpm);
+    if(parts & SESSION_TEMPO) { // base settings
+        cJSON_AddNumberToObject(j_metronome, "base_bpm", BPM_FLOAT(s->base_bpm));
+        cJSON_AddNumberToObject(j_metronome, "bpm", BPM_FLOAT(s->bpm));
 
-        cJSON *count_in = cJSON_CreateObject();
-        cJSON_AddNumberToObject(count_in, "beats", m->count_in.beats);
-        cJSON_AddNumberToObject(count_in, "unit", m->count_in.unit);
-        cJSON_AddObjectToObject(j_metronome, "count_in");
+        cJSON *count_in = cJSON_AddObjectToObject(j_metronome, "count_in");
+        cJSON_AddNumberToObject(count_in, "beats", s->count_in.beats);
+        cJSON_AddNumberToObject(count_in, "unit", s->count_in.unit);
+        save_accents(count_in, &s->count_in);
     }
-    { // Track settings
+    if(parts & SESSION_TRACK) { // Track settings
         cJSON *j_track = cJSON_AddObjectToObject(j_metronome, "track");
-        cJSON_AddItemToObject(j_metronome, "track", j_track);
 
         cJSON *j_measure_obj = cJSON_AddObjectToObject(j_track, "measures");
-        cJSON_AddNumberToObject(j_measure_obj, "measure_count", m->track.measure_count);
+        cJSON_AddNumberToObject(j_measure_obj, "measure_count", s->track.measure_count);
 
         cJSON *j_measures = cJSON_AddArrayToObject(j_measure_obj, "data");
-        for(size_t i=0; i<=m->track.measure_count; ++i) {
+        for(size_t i=0; i<=s->track.measure_count; ++i) {
             cJSON* j_measure = cJSON_CreateObject();
-            cJSON_AddNumberToObject(j_measure, "beats", m->track.measures[i].beats);
-            cJSON_AddNumberToObject(j_measure, "unit", m->track.measures[i].unit);
+            cJSON_AddNumberToObject(j_measure, "beats", s->track.measures[i].beats);
+            cJSON_AddNumberToObject(j_measure, "unit", s->track.measures[i].unit);
+            save_accents(j_measure, &s->track.measures[i]);
 
             cJSON_AddItemToArray(j_measures, j_measure);
         }
     }
-    { // Practice settings
+    if(parts & SESSION_PRACTICE) { // Practice settings
         cJSON *j_practice_obj = cJSON_AddObjectToObject(j_metronome, "practice");
-        cJSON_AddNumberToObject(j_practice_obj, "count", m->practice_count);
+        cJSON_AddNumberToObject(j_practice_obj, "count", s->practice_count);
+        cJSON_AddNumberToObject(j_practice_obj, "autostop", s->practice_autostop);
         cJSON* j_practice_array = cJSON_AddArrayToObject(j_practice_obj, "data");
 
-        for(size_t i=0; i<m->practice_count; ++i) {
+        for(size_t i=0; i<s->practice_count; ++i) {
             cJSON* j_practice = cJSON_CreateObject();
-            cJSON_AddNumberToObject(j_practice, "bpm_from", m->practice[i].bpm_from);
-            cJSON_AddNumberToObject(j_practice, "bpm_to", m->practice[i].bpm_to);
-            cJSON_AddNumberToObject(j_practice, "bpm_step", m->practice[i].bpm_step);
-            cJSON_AddNumberToObject(j_practice, "interval", m->practice[i].interval);
+            cJSON_AddNumberToObject(j_practice, "bpm_from", BPM_FLOAT(s->practice[i].bpm_from));
+            cJSON_AddNumberToObject(j_practice, "bpm_to", BPM_FLOAT(s->practice[i].bpm_to));
+            cJSON_AddNumberToObject(j_practice, "bpm_step", BPM_FLOAT(s->practice[i].bpm_step));
+            cJSON_AddNumberToObject(j_practice, "interval", s->practice[i].interval);
+            cJSON_AddNumberToObject(j_practice, "curve", s->practice[i].curve);
+            cJSON_AddNumberToObject(j_practice, "plateau", s->practice[i].plateau);
+            cJSON_AddNumberToObject(j_practice, "rebound", BPM_FLOAT(s->practice[i].rebound));
+            if(s->practice[i].program != PROGRAM_NONE) {
+                cJSON_AddNumberToObject(j_practice, "program", s->practice[i].program);
+                cJSON_AddNumberToObject(j_practice, "seed", s->practice[i].seed);
+                cJSON_AddNumberToObject(j_practice, "bars", s->practice[i].bars);
+                cJSON_AddNumberToObject(j_practice, "dropout", s->practice[i].dropout);
+            }
 
             cJSON_AddItemToArray(j_practice_array, j_practice);
         }
     }
-    
-    char *jsonstr = cJSON_Print(json);
-    fprintf(f, "%s", jsonstr);
+    if(parts & SESSION_ROUTING) { // Routing, a row of output gains per voice
+        cJSON *j_routing = cJSON_AddObjectToObject(j_metronome, "routing");
+        cJSON_AddNumberToObject(j_routing, "channels", s->routing.channels);
+        for(uint8_t v=0; v<VOICE_COUNT; ++v) {
+            cJSON *j_gains = cJSON_AddArrayToObject(j_routing, metronome_voice_names[v]);
+            for(uint8_t c=0; c<s->routing.channels; ++c) {
+                cJSON_AddItemToArray(j_gains, cJSON_CreateNumber(s->routing.gains[v][c]));
+            }
+        }
+    }
 
-    fclose(f);
+    char *jsonstr = pretty ? cJSON_Print(json) : cJSON_PrintUnformatted(json);
     cJSON_Delete(json);
-    free(jsonstr);
+    return jsonstr;
 }
-void metronome_load(struct Metronome *m) {
-    const char *home = getenv("HOME");
-    const char *rel = "/.local/share/metronome.save";
-    char path[128];
-    sprintf(path, "%s/%s", home, rel);
-    FILE *f = fopen(path, "r");
-    if (f) {
-        fseek(f, 0, SEEK_END);
-        long filesize = ftell(f);
-        fseek(f, 0, SEEK_SET);
+void metronome_save(const struct Metronome *m, const char *path) {
+    const int64_t begin_ns = metronome_trace_begin();
+    char path_buffer[128];
+    metronome_session_path(path, path_buffer, sizeof(path_buffer));
 
-        char *buffer = (char *)malloc(filesize + 1);
-        fread(buffer, 1, filesize, f);
-        buffer[filesize] = '\0';
+    struct Session session;
+    metronome_snapshot(m, &session);
+    char *jsonstr = metronome_session_json(&session, SESSION_ALL, 0x1);
 
-        fclose(f);
+    FILE *f = fopen(path_buffer, "w");
+    fprintf(f, "%s", jsonstr);
 
-        cJSON *json = cJSON_Parse(buffer);
-        if(json == NULL) {
-            const char *error_ptr = cJSON_GetErrorPtr();
-            if(error_ptr != NULL) {
-                fprintf(stderr, "Error before: %s\n", error_ptr);
-            }
-            cJSON_Delete(json);
-            free(buffer);
-            return;
+    fclose(f);
+    free(jsonstr);
+    metronome_trace_span("io", "save", begin_ns);
+}
+// Applies a session in the save file format.
+// A partial document only sets the parts it has, the rest of the session
+// is left as it is. A full one sets missing parts to their defaults.
+static int parse_session(struct Metronome *m, const char *text, const uint8_t partial) {
+    cJSON *json = cJSON_Parse(text);
+    if(json == NULL) {
+        const char *error_ptr = cJSON_GetErrorPtr();
+        if(error_ptr != NULL) {
+            fprintf(stderr, "Error before: %s\n", error_ptr);
         }
+        cJSON_Delete(json);
+        return -1;
+    }
 
-        { // read savefile
-            cJSON *jm = cJSON_GetObjectItemCaseSensitive(json, "metronome");
+    { // read savefile
+        cJSON *jm = cJSON_GetObjectItemCaseSensitive(json, "metronome");
 
-            cJSON* bpm = cJSON_GetObjectItemCaseSensitive(jm, "bpm");
-            m->bpm = cJSON_IsNumber(bpm) ? bpm->valueint : 80;
+        cJSON* bpm = cJSON_GetObjectItemCaseSensitive(jm, "bpm");
+        if(!partial || bpm) { // base settings
+            store_bpm(m, cJSON_IsNumber(bpm) ? BPM(bpm->valuedouble) : BPM(80));
 
             cJSON* base_bpm = cJSON_GetObjectItemCaseSensitive(jm, "base_bpm");
-            m->base_bpm = cJSON_IsNumber(base_bpm) ? base_bpm->valueint : 80;
+            m->base_bpm = cJSON_IsNumber(base_bpm) ? BPM(base_bpm->valuedouble) : BPM(80);
 
             cJSON* count_in = cJSON_GetObjectItemCaseSensitive(jm, "count_in");
             cJSON *count_in_beats = cJSON_GetObjectItemCaseSensitive(count_in, "beats");
             cJSON *count_in_unit  = cJSON_GetObjectItemCaseSensitive(count_in, "unit");
-            m->count_in.beats = cJSON_IsNumber(count_in_beats) ? count_in_beats->valueint : 0;
-            m->count_in.unit  = cJSON_IsNumber(count_in_unit)  ? count_in_unit->valueint  : 0;
-
-            { // track data
-                cJSON *track = cJSON_GetObjectItemCaseSensitive(jm, "track");
-                if(cJSON_IsObject(track)) {
-                    cJSON *measures = cJSON_GetObjectItemCaseSensitive(track, "measures");
-                    if(cJSON_IsObject(measures)) {
-                        cJSON* measure_count = cJSON_GetObjectItemCaseSensitive(measures, "measure_count");
-                        if(cJSON_IsNumber(measure_count)) {
-                            m->track.measure_count = measure_count->valueint;
-                        }
+            // zero in either turns the count-in off
+            const int ci_beats = cJSON_IsNumber(count_in_beats) ? count_in_beats->valueint : 0;
+            const int ci_unit  = cJSON_IsNumber(count_in_unit)  ? count_in_unit->valueint  : 0;
+            m->count_in.beats = (ci_beats > 0) ? clamp(ci_beats, MIN_NOMINATOR, MAX_NOMINATOR) : 0;
+            m->count_in.unit  = (ci_unit > 0) ? clamp(power_of_two(ci_unit), MIN_DENOMINATOR, MAX_DENOMINATOR) : 0;
+            load_accents(count_in, &m->count_in, 0x1);
+        }
+
+        { // track data
+            cJSON *track = cJSON_GetObjectItemCaseSensitive(jm, "track");
+            if(cJSON_IsObject(track)) {
+                cJSON *measures = cJSON_GetObjectItemCaseSensitive(track, "measures");
+                if(cJSON_IsObject(measures)) {
+                    cJSON* measure_count = cJSON_GetObjectItemCaseSensitive(measures, "measure_count");
+                    if(cJSON_IsNumber(measure_count)) {
+                        m->track.measure_count = clamp(measure_count->valueint, 0, TRACK_MEASURE_LIMIT-1);
                     }
-                    cJSON* measure_data = cJSON_GetObjectItemCaseSensitive(measures, "data");
-                    if(cJSON_IsArray(measure_data)) {
-                        for(size_t i=0; i<=m->track.measure_count; ++i) {
-                            cJSON* measure = cJSON_GetArrayItem(measure_data, i);
-                            if(cJSON_IsObject(measure)) {
-                                cJSON* beats = cJSON_GetObjectItemCaseSensitive(measure, "beats");
-                                if(cJSON_IsNumber(beats)) { m->track.measures[i].beats = beats->valueint; }
-
-                                cJSON* unit = cJSON_GetObjectItemCaseSensitive(measure, "unit");
-                                if(cJSON_IsNumber(unit)) { m->track.measures[i].unit = unit->valueint; }
-                            }
+                }
+                cJSON* measure_data = cJSON_GetObjectItemCaseSensitive(measures, "data");
+                if(cJSON_IsArray(measure_data)) {
+                    for(size_t i=0; i<=m->track.measure_count; ++i) {
+                        cJSON* measure = cJSON_GetArrayItem(measure_data, i);
+                        measure_init(&m->track.measures[i], 4, 4);
+                        if(cJSON_IsObject(measure)) {
+                            cJSON* beats = cJSON_GetObjectItemCaseSensitive(measure, "beats");
+                            if(cJSON_IsNumber(beats)) { m->track.measures[i].beats = clamp(beats->valueint, MIN_NOMINATOR, MAX_NOMINATOR); }
+
+                            cJSON* unit = cJSON_GetObjectItemCaseSensitive(measure, "unit");
+                            if(cJSON_IsNumber(unit)) { m->track.measures[i].unit = clamp(power_of_two(unit->valueint), MIN_DENOMINATOR, MAX_DENOMINATOR); }
+
+                            load_accents(measure, &m->track.measures[i], 0x0);
                         }
                     }
                 }
             }
-            { // practice data
-                cJSON* practices = cJSON_GetObjectItemCaseSensitive(jm, "practice");
-                if(cJSON_IsObject(practices)) {
-                    cJSON* practice_count = cJSON_GetObjectItemCaseSensitive(practices, "count");
-                    if(cJSON_IsNumber(practice_count)) { m->practice_count = practice_count->valueint; }
-                    if(m->practice_count > 0) { m->practice_active = 1; }
-
-                    cJSON* practice_data = cJSON_GetObjectItemCaseSensitive(practices, "data");
-                    for(size_t i=0; i<m->practice_count; ++i) {
-                        m->practice[i].iteration = 0;
-
-                        cJSON* practice = cJSON_GetArrayItem(practice_data, i);
-                        if(cJSON_IsObject(practice)) {
-                            cJSON* bpm_from = cJSON_GetObjectItemCaseSensitive(practice, "bpm_from");
-                            if(cJSON_IsNumber(bpm_from)) { m->practice[i].bpm_from = bpm_from->valueint; }
-
-                            cJSON* bpm_to = cJSON_GetObjectItemCaseSensitive(practice, "bpm_to");
-                            if(cJSON_IsNumber(bpm_to)) { m->practice[i].bpm_to = bpm_to->valueint; }
-
-                            cJSON* bpm_step = cJSON_GetObjectItemCaseSensitive(practice, "bpm_step");
-                            if(cJSON_IsNumber(bpm_step)) { m->practice[i].bpm_step = bpm_step->valueint; }
-
-                            cJSON* interval = cJSON_GetObjectItemCaseSensitive(practice, "interval");
-                            if(cJSON_IsNumber(interval)) { m->practice[i].interval = interval->valueint; }
+        }
+        { // practice data
+            cJSON* practices = cJSON_GetObjectItemCaseSensitive(jm, "practice");
+            if(cJSON_IsObject(practices)) {
+                cJSON* practice_count = cJSON_GetObjectItemCaseSensitive(practices, "count");
+                if(cJSON_IsNumber(practice_count)) { m->practice_count = clamp(practice_count->valueint, 0, MAX_PRACTICE_SETS); }
+                if(m->practice_count > 0) { m->practice_active = 1; }
+
+                cJSON* autostop = cJSON_GetObjectItemCaseSensitive(practices, "autostop");
+                m->practice_autostop = cJSON_IsNumber(autostop) ? autostop->valueint : 1;
+
+                cJSON* practice_data = cJSON_GetObjectItemCaseSensitive(practices, "data");
+                for(size_t i=0; i<m->practice_count; ++i) {
+                    m->practice[i].iteration = 0;
+                    m->practice[i].stage = PRACTICE_RAMP;
+
+                    cJSON* practice = cJSON_GetArrayItem(practice_data, i);
+                    if(cJSON_IsObject(practice)) {
+                        cJSON* bpm_from = cJSON_GetObjectItemCaseSensitive(practice, "bpm_from");
+                        if(cJSON_IsNumber(bpm_from)) { m->practice[i].bpm_from = BPM(bpm_from->valuedouble); }
+
+                        cJSON* bpm_to = cJSON_GetObjectItemCaseSensitive(practice, "bpm_to");
+                        if(cJSON_IsNumber(bpm_to)) { m->practice[i].bpm_to = BPM(bpm_to->valuedouble); }
+
+                        cJSON* bpm_step = cJSON_GetObjectItemCaseSensitive(practice, "bpm_step");
+                        if(cJSON_IsNumber(bpm_step)) { m->practice[i].bpm_step = BPM(bpm_step->valuedouble); }
+
+                        cJSON* interval = cJSON_GetObjectItemCaseSensitive(practice, "interval");
+                        m->practice[i].interval = cJSON_IsNumber(interval) ? clamp(interval->valueint, 1, 255) : 1;
+
+                        cJSON* curve = cJSON_GetObjectItemCaseSensitive(practice, "curve");
+                        m->practice[i].curve = cJSON_IsNumber(curve) ? curve->valueint : PRACTICE_STEP;
+
+                        cJSON* plateau = cJSON_GetObjectItemCaseSensitive(practice, "plateau");
+                        m->practice[i].plateau = cJSON_IsNumber(plateau) ? plateau->valueint : 0;
+
+                        cJSON* rebound = cJSON_GetObjectItemCaseSensitive(practice, "rebound");
+                        m->practice[i].rebound = cJSON_IsNumber(rebound) ? BPM(rebound->valuedouble) : 0;
+
+                        cJSON* program = cJSON_GetObjectItemCaseSensitive(practice, "program");
+                        m->practice[i].program = (cJSON_IsNumber(program) && program->valueint < PROGRAM_COUNT) ? program->valueint : PROGRAM_NONE;
+                        // a ramp that steps by nothing never reaches bpm_to, no less
+                        // than the wizard's smallest step. Programs read 0 as any.
+                        if(m->practice[i].program == PROGRAM_NONE) {
+                            m->practice[i].bpm_step = max(m->practice[i].bpm_step, (bpm_t)1);
                         }
+
+                        cJSON* seed = cJSON_GetObjectItemCaseSensitive(practice, "seed");
+                        m->practice[i].seed = cJSON_IsNumber(seed) ? (uint32_t)seed->valuedouble : 0;
+
+                        cJSON* bars = cJSON_GetObjectItemCaseSensitive(practice, "bars");
+                        m->practice[i].bars = cJSON_IsNumber(bars) ? (uint32_t)bars->valuedouble : 0;
+
+                        cJSON* dropout = cJSON_GetObjectItemCaseSensitive(practice, "dropout");
+                        m->practice[i].dropout = cJSON_IsNumber(dropout) ? min(dropout->valueint, 100) : 0;
                     }
                 }
             }
         }
+        cJSON *routing = cJSON_GetObjectItemCaseSensitive(jm, "routing");
+        if(!partial || routing) { // routing, sessions without one play every voice on the pair
+            metronome_routing_default(&m->routing);
+            if(cJSON_IsObject(routing)) {
+                struct Routing *r = &m->routing;
+                memset(r->gains, 0, sizeof(r->gains));
+                cJSON *channels = cJSON_GetObjectItemCaseSensitive(routing, "channels");
+                r->channels = cJSON_IsNumber(channels) ? clamp(channels->valueint, 1, MAX_ROUTE_CHANNELS) : 2;
 
-        cJSON_Delete(json);
+                // a voice left out is not heard
+                for(uint8_t v=0; v<VOICE_COUNT; ++v) {
+                    cJSON *gains = cJSON_GetObjectItemCaseSensitive(routing, metronome_voice_names[v]);
+                    for(int c=0; cJSON_IsArray(gains) && c<cJSON_GetArraySize(gains) && c<r->channels; ++c) {
+                        const cJSON *gain = cJSON_GetArrayItem(gains, c);
+                        if(cJSON_IsNumber(gain)) { r->gains[v][c] = gain->valuedouble; }
+                    }
+                }
+                metronome_routing_compile(r);
+            }
+            publish_routing(m);
+        }
+    }
+
+    cJSON_Delete(json);
+    const uint8_t active = min(load_active(&m->track), m->track.measure_count);
+    store_active(&m->track, active);
+    m->track.revision++;
+    publish_now(m, TRACK_ALL, active);
+    return 0;
+}
+int metronome_parse(struct Metronome *m, const char *text) {
+    return parse_session(m, text, 0x0);
+}
+int metronome_parse_parts(struct Metronome *m, const char *text) {
+    return parse_session(m, text, 0x1);
+}
+static int load_session(struct Metronome *m, const char *path) {
+    char path_buffer[128];
+    metronome_session_path(path, path_buffer, sizeof(path_buffer));
+    FILE *f = fopen(path_buffer, "r");
+    if (f) {
+        fseek(f, 0, SEEK_END);
+        long filesize = ftell(f);
+        fseek(f, 0, SEEK_SET);
+
+        char *buffer = (filesize >= 0) ? (char *)malloc(filesize + 1) : NULL;
+        if(buffer == NULL) {
+            fclose(f);
+            return -1;
+        }
+        const size_t read = fread(buffer, 1, filesize, f);
+        buffer[read] = '\0';
+
+        fclose(f);
+
+        const int result = metronome_parse(m, buffer);
         free(buffer);
+        return result;
     } else {
-        m->bpm      = 80.0;
-        m->track.measures[0].beats    = 4;
-        m->track.measures[0].unit     = 4;
+        store_bpm(m, BPM(80));
+        measure_init(&m->track.measures[0], 4, 4);
+        publish_now(m, TRACK_MEASURE, 0);
+        return -1;
     }
 }
-int metronome_setup(struct Metronome *m) {
+int metronome_load(struct Metronome *m, const char *path) {
+    const int64_t begin_ns = metronome_trace_begin();
+    const int result = load_session(m, path);
+    metronome_trace_span("io", "load", begin_ns);
+    return result;
+}
+void metronome_init(struct Metronome *m) {
     m->tick = 1;
+    m->seek = 0x0;
+    m->reset = 0x0;
+    memset(&m->changes, 0, sizeof(m->changes));
+    for(uint32_t i=0; i<CHANGE_QUEUE; ++i) {
+        m->changes.slots[i].sequence = i;
+    }
+    memset(&m->sync, 0, sizeof(m->sync));
+    m->sync.ratio = 1.0;
+    m->beat_head = 0;
+    m->beat_writing = 0;
+    m->status = NULL;
+    memset(&m->engine, 0, sizeof(m->engine));
     m->track.active_measure = 0;
     m->track.measure_count = 0;
+    m->track.looping = 0x0;
+    m->track.revision = 0;
+    m->map.measure_count = 0;
 
-    m->bpm = 42;
-    m->track.measures[0].beats = 7;
-    m->track.measures[0].unit = 8;
+    m->bpm = BPM(42);
+    measure_init(&m->track.measures[0], 7, 8);
+    measure_init(&m->count_in, 0, 0);
+    compile_measure(&m->count_in, 0x1);
 
     m->practice_count = 0;
-    
-    metronome_load(m);
+    m->practice_current = 0;
+    m->practice_active = 0x0;
+    m->practice_silent = 0x0;
+    m->practice_autostop = 0x1;
+
+    m->channel = 0;
+    metronome_routing_default(&m->routing);
+    m->routes[0] = m->routing;
+    m->route_live = 0;
+    m->hosted = 0x0;
+    m->realtime = 0x0;
+    m->realtime_granted = 0;
+    m->realtime_tried = 0x0;
+    m->rendering = 0;
+    m->clock_sequence = 0;
+    m->clock_ns = 0;
+    m->clock_frame = 0;
+    m->latency_ns = 0;
+    m->idle_ms = IDLE_TIMEOUT_MS;
+    m->stopped_ns = 0;
+    m->device_threaded = 0x0;
+    m->device_closing = 0x0;
+    m->device_state = DEVICE_FAILED;
+    m->device_result = MA_DEVICE_NOT_INITIALIZED;
     m->state = METRONOME_STOPPED;
 
-    ma_result result;
+    pthread_mutex_init(&m->track_lock, NULL);
+    m->published = NULL;
+    m->retired_count = 0;
+    m->track_stale = 0x0;
+    publish_now(m, TRACK_ALL, 0);
+    m->playing = m->published;
+}
+static int64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+static uint8_t open_device(struct Metronome *m) {
+    const int64_t begin_ns = metronome_trace_begin();
     ma_device_config device_config;
 
+    device_config                       = ma_device_config_init(ma_device_type_playback);
+    device_config.playback.format       = ma_format_f32;
+    device_config.playback.channels     = 0;     // the device's own, routing decides which are used
+    device_config.sampleRate            = SAMPLE_RATE;
+    device_config.periodSizeInFrames    = PERIOD_FRAMES;
+    device_config.periods               = 2;
+    device_config.performanceProfile    = ma_performance_profile_low_latency;
+    device_config.pUserData             = m;
+    device_config.dataCallback          = data_callback;
+
+    const ma_result result = ma_device_init(NULL, &device_config, &m->device);
+    metronome_trace_span("device", "open", begin_ns);
+    m->device_result = result;
+    if(result != MA_SUCCESS) {
+        return DEVICE_FAILED;
+    }
+    // the periods queued ahead of the one being rendered, as the backend
+    // actually set them up
+    const ma_uint32 buffered = m->device.playback.internalPeriodSizeInFrames * m->device.playback.internalPeriods;
+    const ma_uint32 rate = m->device.playback.internalSampleRate ? m->device.playback.internalSampleRate : SAMPLE_RATE;
+    __atomic_store_n(&m->latency_ns, (int64_t)buffered * 1000000000 / rate, __ATOMIC_RELEASE);
+    return DEVICE_IDLE;
+}
+// Opens the device, then sleeps until a stopped device has been idle for
+// idle_ms and stops it. A practice program ending stops the session
+// without metronome_stop(), that idle time is counted from when this
+// thread first sees it.
+static void *device_main(void *arg) {
+    struct Metronome *m = arg;
+    const uint8_t opened = open_device(m);
+
+    pthread_mutex_lock(&m->device_lock);
+    m->device_state = opened;
+    pthread_cond_broadcast(&m->device_wake);
+    while(!m->device_closing) {
+        if(m->device_state != DEVICE_RUNNING || m->idle_ms == 0) {
+            pthread_cond_wait(&m->device_wake, &m->device_lock);
+            continue;
+        }
+        const int64_t now_ns = monotonic_ns();
+        int64_t release_ns = now_ns + (int64_t)m->idle_ms * 1000000;
+        if(__atomic_load_n(&m->state, __ATOMIC_ACQUIRE) == METRONOME_STOPPED) {
+            if(m->stopped_ns == 0) { m->stopped_ns = now_ns; }
+            release_ns = m->stopped_ns + (int64_t)m->idle_ms * 1000000;
+            if(now_ns >= release_ns) {
+                const int64_t begin_ns = metronome_trace_begin();
+                ma_device_stop(&m->device);
+                metronome_trace_span("device", "release", begin_ns);
+                m->device_state = DEVICE_IDLE;
+                continue;
+            }
+        }
+        const struct timespec when = {release_ns / 1000000000, release_ns % 1000000000};
+        pthread_cond_timedwait(&m->device_wake, &m->device_lock, &when);
+    }
+    pthread_mutex_unlock(&m->device_lock);
+    return NULL;
+}
+// Opening the device takes a good part of a second on some backends, so
+// it runs on its own thread alongside loading the session and whatever
+// the caller sets up next. metronome_start() waits for it if it must.
+// Returns the error of an open that already failed, MA_SUCCESS otherwise;
+// check metronome_wait_device() before playing.
+int metronome_setup(struct Metronome *m) {
+    metronome_init(m);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m->device_wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&m->device_lock, NULL);
+
+    m->device_state = DEVICE_OPENING;
+    m->device_result = MA_SUCCESS;
+    m->device_threaded = (pthread_create(&m->device_thread, NULL, device_main, m) == 0);
+    if(!m->device_threaded) {
+        // no idle release without the thread, the device just stays open
+        m->device_state = open_device(m);
+    }
+
+    metronome_load(m, NULL);
+    pthread_mutex_lock(&m->device_lock);
+    const ma_result result = (m->device_state == DEVICE_FAILED) ? m->device_result : MA_SUCCESS;
+    pthread_mutex_unlock(&m->device_lock);
+    return result;
+}
+void metronome_shutdown(struct Metronome *m) {
+    pthread_mutex_lock(&m->device_lock);
+    m->device_closing = 0x1;
+    pthread_cond_broadcast(&m->device_wake);
+    pthread_mutex_unlock(&m->device_lock);
+    if(m->device_threaded) {
+        pthread_join(m->device_thread, NULL);
+    }
+
+    if(m->device_state != DEVICE_FAILED) {
+        ma_device_uninit(&m->device);
+    }
+    pthread_cond_destroy(&m->device_wake);
+    pthread_mutex_destroy(&m->device_lock);
+    metronome_track_free(m);
+}
+// Blocks until the device is open. Returns MA_SUCCESS, or the ma_result
+// it failed to open with.
+int metronome_wait_device(struct Metronome *m) {
+    pthread_mutex_lock(&m->device_lock);
+    while(m->device_state == DEVICE_OPENING) {
+        pthread_cond_wait(&m->device_wake, &m->device_lock);
+    }
+    const ma_result result = (m->device_state == DEVICE_FAILED) ? m->device_result : MA_SUCCESS;
+    pthread_mutex_unlock(&m->device_lock);
+    return result;
+}
+// Opt in to real-time playback, best effort. Locks the process in memory,
+// or failing that at least the session, and prefaults it. Scheduling is
+// requested by the callback thread itself once it first runs, so
+// REALTIME_SCHEDULING only shows up in realtime_granted after a start.
+uint8_t metronome_realtime(struct Metronome *m) {
+    uint8_t granted = 0;
+    if(mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+        granted |= REALTIME_LOCKED;
+    } else if(mlock(m, sizeof(*m)) == 0) {
+        granted |= REALTIME_SESSION;
+    }
+    // the device thread writes m->device until it is open
+    metronome_wait_device(m);
+    prefault(m);
+    granted |= REALTIME_PREFAULTED;
+
+    m->realtime = 0x1;
+    return __atomic_or_fetch(&m->realtime_granted, granted, __ATOMIC_ACQ_REL);
+}
+void metronome_realtime_describe(const uint8_t granted, char *out, const size_t size) {
+    snprintf(out, size, "fifo %s, memory %s, prefaulted %s",
+        (granted & REALTIME_SCHEDULING) ? "yes" : "no",
+        (granted & REALTIME_LOCKED) ? "locked" : (granted & REALTIME_SESSION) ? "session only" : "unlocked",
+        (granted & REALTIME_PREFAULTED) ? "yes" : "no"
+    );
+}
+int metronome_host_setup(struct MetronomeHost *h, const uint8_t channels) {
+    memset(h->sessions, 0, sizeof(h->sessions));
+    h->session_count = 0;
+    h->rendering = 0;
+    h->channels = max(channels, (uint8_t)2);
+
+    ma_device_config device_config;
     device_config                   = ma_device_config_init(ma_device_type_playback);
     device_config.playback.format   = ma_format_f32;
-    device_config.playback.channels = 2;
+    device_config.playback.channels = h->channels;
     device_config.sampleRate        = SAMPLE_RATE;
-    device_config.pUserData         = m;
-    device_config.dataCallback      = data_callback;
+    device_config.pUserData         = h;
+    device_config.dataCallback      = host_callback;
 
-    result = ma_device_init(NULL, &device_config, &m->device);
-    if(result != MA_SUCCESS) {
+    if(ma_device_init(NULL, &device_config, &h->device) != MA_SUCCESS) {
         printf("FAILED to OPEN playback device!\n");
         return -1;
     }
+    // channel count is whatever the device actually gave us
+    h->channels = h->device.playback.channels;
 
-    // Start device
-    result = ma_device_start(&m->device);
-    if(result != MA_SUCCESS) {
+    if(ma_device_start(&h->device) != MA_SUCCESS) {
         printf("FAILED to START playback device\n");
         return -1;
     }
     return 0;
 }
-void metronome_shutdown(struct Metronome *m) {
-    ma_device_uninit(&m->device);
+struct Metronome *metronome_host_add(struct MetronomeHost *h, const uint8_t channel) {
+    uint8_t slot = 0;
+    while(slot < h->session_count && h->sessions[slot] != NULL) { ++slot; }
+    if(slot >= MAX_SESSIONS || channel+1 >= h->channels) { return NULL; }
+
+    struct Metronome *m = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct Metronome));
+    if(m == NULL) { return NULL; }
+
+    metronome_init(m);
+    m->channel = channel;
+    m->hosted = 0x1;
+
+    // the callback only ever reads the first session_count entries, the
+    // session is complete before either store makes it visible
+    __atomic_store_n(&h->sessions[slot], m, __ATOMIC_RELEASE);
+    if(slot == h->session_count) {
+        __atomic_store_n(&h->session_count, slot+1, __ATOMIC_RELEASE);
+    }
+    return m;
+}
+// Unpublishes the session and waits out a callback that may still be
+// rendering it, the device and every other session keep playing. The
+// slot is left empty for metronome_host_add() rather than refilled with
+// the last session, which a callback that already read session_count
+// would then render twice in one period.
+void metronome_host_remove(struct MetronomeHost *h, struct Metronome *m) {
+    uint8_t i = 0;
+    while(i < h->session_count && h->sessions[i] != m) { ++i; }
+    if(i == h->session_count) { return; }
+
+    __atomic_store_n(&h->sessions[i], NULL, __ATOMIC_SEQ_CST);
+    uint8_t count = h->session_count;
+    while(count > 0 && h->sessions[count-1] == NULL) { --count; }
+    __atomic_store_n(&h->session_count, count, __ATOMIC_RELEASE);
+
+    const uint32_t rendering = __atomic_load_n(&h->rendering, __ATOMIC_SEQ_CST);
+    while((rendering & 1) && __atomic_load_n(&h->rendering, __ATOMIC_ACQUIRE) == rendering) {
+        sched_yield();
+    }
+    metronome_track_free(m);
+    free(m);
 }
-void metronome_insert_measure_at_start(struct Metronome *m) {
-    assert(++m->track.measure_count < 10);
-    
+void metronome_host_shutdown(struct MetronomeHost *h) {
+    ma_device_uninit(&h->device);
+    for(uint8_t i=0; i<h->session_count; ++i) {
+        if(h->sessions[i]) { metronome_track_free(h->sessions[i]); }
+        free(h->sessions[i]);
+        h->sessions[i] = NULL;
+    }
+    h->session_count = 0;
+}
+// Returns -1 without inserting once the track holds TRACK_MEASURE_LIMIT.
+int metronome_insert_measure_at_start(struct Metronome *m) {
+    if(m->track.measure_count+1 >= TRACK_MEASURE_LIMIT) { return -1; }
+    m->track.measure_count++;
+
     for(int i=m->track.measure_count+1; i>0; --i) {
         m->track.measures[i] = m->track.measures[i-1];
     }
 
-    m->track.active_measure=0;
-    m->track.measures[0].beats = 4;
-    m->track.measures[0].unit = 4;
+    store_active(&m->track, 0);
+    measure_init(&m->track.measures[0], 4, 4);
+    m->track.revision++;
+    publish_now(m, TRACK_INSERT, 0);
+    return 0;
 }
-void metronome_insert_measure_before(struct Metronome *m) {
-    assert(++m->track.measure_count < 10);
+int metronome_insert_measure_before(struct Metronome *m) {
+    if(m->track.measure_count+1 >= TRACK_MEASURE_LIMIT) { return -1; }
+    m->track.measure_count++;
 
-    for(int i=m->track.measure_count+1; i>m->track.active_measure; --i) {
+    const uint8_t at = load_active(&m->track);
+    for(int i=m->track.measure_count+1; i>at; --i) {
         m->track.measures[i] = m->track.measures[i-1];
     }
 
-    m->track.measures[m->track.active_measure].beats = 4;
-    m->track.measures[m->track.active_measure].unit = 4;
+    measure_init(&m->track.measures[at], 4, 4);
+    m->track.revision++;
+    publish_now(m, TRACK_INSERT, at);
+    return 0;
 }
-void metronome_insert_measure_after(struct Metronome *m) {
-    assert(++m->track.measure_count < 10);
+int metronome_insert_measure_after(struct Metronome *m) {
+    if(m->track.measure_count+1 >= TRACK_MEASURE_LIMIT) { return -1; }
+    m->track.measure_count++;
 
-    for(int i=m->track.measure_count+1; i>m->track.active_measure+1; --i) {
+    const uint8_t at = load_active(&m->track)+1;
+    for(int i=m->track.measure_count+1; i>at; --i) {
         m->track.measures[i] = m->track.measures[i-1];
     }
 
-    m->track.active_measure++;
-    m->track.measures[m->track.active_measure].beats = 4;
-    m->track.measures[m->track.active_measure].unit = 4;
+    store_active(&m->track, at);
+    measure_init(&m->track.measures[at], 4, 4);
+    m->track.revision++;
+    publish_now(m, TRACK_INSERT, at);
+    return 0;
 }
-void metronome_insert_measure_at_end(struct Metronome *m) {
-    assert(++m->track.measure_count < 10);
-    m->track.measures[m->track.measure_count].beats = 4;
-    m->track.measures[m->track.measure_count].unit = 4;
-    m->track.active_measure = m->track.measure_count;
+int metronome_insert_measure_at_end(struct Metronome *m) {
+    if(m->track.measure_count+1 >= TRACK_MEASURE_LIMIT) { return -1; }
+    m->track.measure_count++;
+    measure_init(&m->track.measures[m->track.measure_count], 4, 4);
+    store_active(&m->track, m->track.measure_count);
+    m->track.revision++;
+    publish_now(m, TRACK_INSERT, m->track.measure_count);
+    return 0;
 }
 void metronome_remove_measure(struct Metronome *m) {
     if (m->track.measure_count < 1) { return; }
 
-    for(int i=m->track.active_measure; i<=m->track.measure_count; ++i) {
+    const uint8_t removed = load_active(&m->track);
+    for(int i=removed; i<=m->track.measure_count; ++i) {
         m->track.measures[i] = m->track.measures[i+1];
     }
     m->track.measure_count--;
-    m->track.active_measure =
-        (m->track.active_measure > m->track.measure_count)
-        ? m->track.measure_count
-        : m->track.active_measure
-    ;
+    store_active(&m->track, min(removed, m->track.measure_count));
+    if(m->track.looping && m->track.loop_to > m->track.measure_count) {
+        m->track.loop_to   = m->track.measure_count;
+        m->track.loop_from = min(m->track.loop_from, m->track.loop_to);
+    }
+    m->track.revision++;
+    publish_now(m, TRACK_REMOVE, removed);
+}
+// Whether the tempo holds for the rest of the pass: no ramp or program
+// is moving it and no change is waiting for a beat or bar line.
+static uint8_t tempo_fixed(const struct Metronome *m) {
+    const struct Practice *p = &m->practice[m->practice_current];
+    const uint8_t moving = m->practice_active && (p->program != PROGRAM_NONE || practice_ramping(m));
+    return !moving && !metronome_change_queued(m);
+}
+const struct TempoMap *metronome_tempo_map(struct Metronome *m) {
+    struct TempoMap *map = &m->map;
+    map->exact = tempo_fixed(m);
+    const bpm_t bpm = load_bpm(m);
+    if(map->revision == m->track.revision && map->bpm == bpm && map->measure_count == m->track.measure_count+1) {
+        return map;
+    }
+
+    map->measure_count = m->track.measure_count+1;
+    map->revision = m->track.revision;
+    map->bpm = bpm;
+    map->measure_start[0] = 0.0;
+    for(uint8_t i=0; i<map->measure_count; ++i) {
+        const struct Measure *measure = &m->track.measures[i];
+        map->beat_samples[i] = beat_length(BPM_FLOAT(bpm), BPM_FLOAT(bpm), PRACTICE_STEP, measure->unit);
+        map->measure_start[i+1] = map->measure_start[i] + map->beat_samples[i]*measure->beats;
+    }
+    return map;
+}
+struct Position metronome_locate(const struct TempoMap *map, uint64_t sample) {
+    struct Position pos = {0};
+    const double length = map->measure_start[map->measure_count];
+    if(length <= 0.0) { return pos; }
+
+    // positions past the end wrap around, the way the track repeats
+    const double s = fmod((double)sample, length);
+
+    uint8_t lo = 0;
+    uint8_t hi = map->measure_count-1;
+    while(lo < hi) {
+        const uint8_t mid = (lo + hi + 1) / 2;
+        if(map->measure_start[mid] <= s) { lo = mid; } else { hi = mid-1; }
+    }
+
+    const double into = s - map->measure_start[lo];
+    const uint8_t beats = (uint8_t)round((map->measure_start[lo+1] - map->measure_start[lo]) / map->beat_samples[lo]);
+    pos.measure = lo;
+    pos.beat    = min((uint8_t)(into / map->beat_samples[lo]), (uint8_t)(beats-1));
+    pos.offset  = (uint32_t)(into - pos.beat*map->beat_samples[lo]);
+    return pos;
+}
+uint64_t metronome_position_to_sample(const struct TempoMap *map, const struct Position *pos) {
+    const uint8_t measure = min(pos->measure, (uint8_t)(map->measure_count-1));
+    return (uint64_t)(map->measure_start[measure] + pos->beat*map->beat_samples[measure]) + pos->offset;
+}
+// The position goes over whole in one store before the flag, so the
+// callback never sees the flag with half of it.
+static void post_seek(struct Metronome *m, struct Position to) {
+    __atomic_store(&m->seek_to, &to, __ATOMIC_RELAXED);
+    __atomic_store_n(&m->seek, 0x1, __ATOMIC_RELEASE);
+}
+void metronome_seek(struct Metronome *m, uint8_t measure, uint8_t beat) {
+    const struct Position to = {.measure = min(measure, m->track.measure_count), .beat = beat, .offset = 0};
+    post_seek(m, to);
+}
+// -1 without seeking while the tempo is moving, the map would put the
+// sample on the wrong beat.
+int metronome_seek_sample(struct Metronome *m, uint64_t sample) {
+    const struct TempoMap *map = metronome_tempo_map(m);
+    if(!map->exact) { return -1; }
+    post_seek(m, metronome_locate(map, sample));
+    return 0;
 }
-void metronome_practice_set_from_bpm(struct Practice *p, uint8_t bpm) {
-    p->bpm_from = (bpm>0 && bpm<255) ? bpm : 1;
+void metronome_set_loop(struct Metronome *m, uint8_t from, uint8_t to) {
+    to   = min(to, m->track.measure_count);
+    from = min(from, to);
+    m->track.loop_from = from;
+    m->track.loop_to   = to;
+    m->track.looping   = 0x1;
+    publish_now(m, TRACK_LAYOUT, load_active(&m->track));
 }
+void metronome_clear_loop(struct Metronome *m) {
+    m->track.looping = 0x0;
+    publish_now(m, TRACK_LAYOUT, load_active(&m->track));
+}
+void metronome_practice_start(struct Metronome *m, uint8_t set) {
+    if(set >= m->practice_count) { return; }
+    practice_enter(m, set);
+    store_active(&m->track, m->track.looping ? m->track.loop_from : 0);
+    m->reset = 0x1;
+    m->tick = 1;
+    m->practice_active = 0x1;
+}
+// Returns -1 when CHANGE_QUEUE changes are already waiting.
+int metronome_queue_change(struct Metronome *m, bpm_t bpm, uint8_t beats, uint8_t unit, uint8_t quantize) {
+    if(bpm > 0) {
+        bpm = clamp(bpm, MIN_BPM, MAX_BPM);
+    }
+    if(beats > 0) {
+        beats = clamp(beats, MIN_NOMINATOR, MAX_NOMINATOR);
+        unit  = clamp(power_of_two(unit), MIN_DENOMINATOR, MAX_DENOMINATOR);
+    }
+
+    if(quantize == QUANTIZE_NOW || __atomic_load_n(&m->state, __ATOMIC_RELAXED) == METRONOME_STOPPED) {
+        if(bpm > 0) { store_bpm(m, bpm); }
+        if(beats > 0) {
+            metronome_set_beats(m, beats);
+            metronome_set_unit(m, unit);
+        }
+        return 0;
+    }
+
+    if(bpm > 0) {
+        // claim a slot first, so threads queueing at once never share one
+        struct ChangeQueue *q = &m->changes;
+        uint32_t head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        struct Change *c;
+        for(;;) {
+            c = &q->slots[head % CHANGE_QUEUE];
+            const int32_t turn = (int32_t)(__atomic_load_n(&c->sequence, __ATOMIC_ACQUIRE) - head);
+            if(turn < 0) { return -1; }
+            if(turn == 0 && __atomic_compare_exchange_n(&q->head, &head, head+1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { break; }
+            if(turn > 0) { head = __atomic_load_n(&q->head, __ATOMIC_RELAXED); }
+        }
+        c->bpm      = bpm;
+        c->quantize = quantize;
+        __atomic_store_n(&c->sequence, head+1, __ATOMIC_RELEASE);
+    }
+    if(beats > 0) {
+        // the meter goes to the measure the beat or bar line lands in, as a
+        // version the callback takes up once it gets there
+        struct Track *t = &m->track;
+        uint8_t k = load_active(t);
+        if(quantize == QUANTIZE_BAR) {
+            const uint8_t first = t->looping ? t->loop_from : 0;
+            const uint8_t last  = t->looping ? t->loop_to : t->measure_count;
+            k = (k >= first && k < last) ? k+1 : first;
+        }
+        t->measures[k].beats = beats;
+        t->measures[k].unit  = unit;
+        t->revision++;
+        publish_edit(m, TRACK_MEASURE, k, quantize, k);
+    }
+    return 0;
+}
+// Whether a tempo change or a version of the track waits for its beat or
+// bar line.
+uint8_t metronome_change_queued(const struct Metronome *m) {
+    return __atomic_load_n(&m->changes.head, __ATOMIC_ACQUIRE) != __atomic_load_n(&m->changes.tail, __ATOMIC_ACQUIRE)
+        || (__atomic_load_n(&m->published_waits, __ATOMIC_ACQUIRE)
+            && __atomic_load_n(&m->published, __ATOMIC_ACQUIRE) != __atomic_load_n(&m->playing, __ATOMIC_ACQUIRE));
+}
+// Copies the beats played since tail, oldest first, and returns the new
+// tail. A reader that fell more than BEAT_EVENTS behind skips ahead.
+uint32_t metronome_read_beats(const struct Metronome *m, uint32_t tail, struct BeatEvent *events, uint32_t max_events) {
+    for(;;) {
+        const uint32_t head = __atomic_load_n(&m->beat_head, __ATOMIC_ACQUIRE);
+        const uint32_t first = (head - tail > BEAT_EVENTS) ? head - BEAT_EVENTS : tail;
+        uint32_t count = 0;
+        while(first+count != head && count < max_events) {
+            copy_event(&events[count], &m->beat_events[(first+count) % BEAT_EVENTS]);
+            count++;
+        }
+        // the callback lapped the oldest slot copied while it was copied,
+        // read again from where it is now
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&m->beat_writing, __ATOMIC_RELAXED) - first <= BEAT_EVENTS) {
+            return first+count;
+        }
+    }
+}
+void metronome_practice_set_from_bpm(struct Practice *p, bpm_t bpm) {
+    p->bpm_from = (bpm>=MIN_BPM && bpm<MAX_BPM) ? bpm : MIN_BPM;
+}
+// The state is set before a cold start so the first period the device
+// asks for already opens on the click. A warm device picks it up within
+// one period.
 void metronome_start(struct Metronome *m) {
-    ma_device_start(&m->device);
-    m->state = METRONOME_STARTED;
+    if(m->hosted) {
+        __atomic_store_n(&m->state, METRONOME_STARTED, __ATOMIC_RELEASE);
+        return;
+    }
+    pthread_mutex_lock(&m->device_lock);
+    while(m->device_state == DEVICE_OPENING) {
+        pthread_cond_wait(&m->device_wake, &m->device_lock);
+    }
+    m->stopped_ns = 0;
+    __atomic_store_n(&m->state, METRONOME_STARTED, __ATOMIC_RELEASE);
+    if(m->device_state == DEVICE_IDLE) {
+        const int64_t begin_ns = metronome_trace_begin();
+        if(m->realtime) { prefault(m); }
+        const ma_result result = ma_device_start(&m->device);
+        metronome_trace_span("device", "start", begin_ns);
+        if(result == MA_SUCCESS) {
+            m->device_state = DEVICE_RUNNING;
+            pthread_cond_broadcast(&m->device_wake);
+        }
+    }
+    pthread_mutex_unlock(&m->device_lock);
 }
+// The device keeps running, silent, until the device thread releases it.
+// Returns once no callback can still be rendering the session, as the
+// device stopping used to guarantee.
 void metronome_stop(struct Metronome *m) {
-    ma_device_stop(&m->device);
-    m->state = METRONOME_STOPPED;
+    if(m->hosted) {
+        __atomic_store_n(&m->state, METRONOME_STOPPED, __ATOMIC_SEQ_CST);
+        return;
+    }
+    pthread_mutex_lock(&m->device_lock);
+    __atomic_store_n(&m->state, METRONOME_STOPPED, __ATOMIC_SEQ_CST);
+    m->stopped_ns = monotonic_ns();
+    pthread_cond_broadcast(&m->device_wake);
+    pthread_mutex_unlock(&m->device_lock);
+    metronome_wait_render(m);
+}
+// Returns once a callback that was inside this session when called has
+// left it. Whatever was unpublished before the call is no longer read.
+void metronome_wait_render(struct Metronome *m) {
+    const uint32_t rendering = __atomic_load_n(&m->rendering, __ATOMIC_SEQ_CST);
+    while((rendering & 1) && __atomic_load_n(&m->rendering, __ATOMIC_ACQUIRE) == rendering) {
+        sched_yield();
+    }
 }
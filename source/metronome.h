@@ -1,56 +1,354 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <miniaudio.h>
 
 #define MAX_TRACKS              16
 #define MAX_MEASURES_PER_TRACK  32
+#define TRACK_MEASURE_LIMIT     10      // measures a track grows to, by inserts or a load
 #define MAX_PRACTICE_SETS       32
+#define MAX_BEATS_PER_MEASURE   32
+#define MAX_SESSIONS            64
+#define BEAT_EVENTS             64
+#define CHANGE_QUEUE            8
+#define TRACK_RETIRED           8
+#define MAX_ROUTE_CHANNELS      16
+
+#define SAMPLE_RATE             (44100)
+#define PERIOD_FRAMES           (128)   // two of these ask for about 6 ms of buffering
+#define IDLE_TIMEOUT_MS         (30000)
+
+// tempo is fixed point with 1/BPM_SCALE resolution, 13250 == 132.5 BPM
+#define BPM_SCALE               100
+#define BPM(x)                  ((bpm_t)((x)*BPM_SCALE + 0.5))
+#define BPM_FLOAT(b)            ((double)(b)/BPM_SCALE)
+#define MIN_BPM                 BPM(1)
+#define MAX_BPM                 BPM(999)
+
+typedef uint32_t bpm_t;
+
+#define CACHE_LINE_SIZE         64
+#define CACHE_ALIGNED           __attribute__((aligned(CACHE_LINE_SIZE)))
 
 enum MetronomeState { METRONOME_STOPPED, METRONOME_STARTED, METRONOME_RUNNING };
+enum PracticeCurve { PRACTICE_STEP, PRACTICE_LINEAR, PRACTICE_EXPONENTIAL };
+enum PracticeStage { PRACTICE_RAMP, PRACTICE_PLATEAU, PRACTICE_REBOUND };
+enum PracticeProgram { PROGRAM_NONE, PROGRAM_RANDOM, PROGRAM_BURSTS, PROGRAM_DROPOUT, PROGRAM_CYCLE, PROGRAM_COUNT };
+enum Quantize { QUANTIZE_NOW, QUANTIZE_BEAT, QUANTIZE_BAR };
+enum DeviceState { DEVICE_OPENING, DEVICE_FAILED, DEVICE_IDLE, DEVICE_RUNNING };
+enum RealtimeGuarantee {
+    REALTIME_SCHEDULING = 1 << 0,   // the callback thread runs SCHED_FIFO
+    REALTIME_LOCKED     = 1 << 1,   // the whole process is locked in memory
+    REALTIME_SESSION    = 1 << 2,   // only the session itself is locked
+    REALTIME_PREFAULTED = 1 << 3,
+};
+enum Accent { ACCENT_AUTO, ACCENT_MUTE, ACCENT_GHOST, ACCENT_NORMAL, ACCENT_STRONG, ACCENT_DOWNBEAT, ACCENT_COUNT };
+enum Voice { VOICE_DOWNBEAT, VOICE_ACCENT, VOICE_BEAT, VOICE_GHOST, VOICE_COUNT_IN, VOICE_COUNT };
+
+struct MetronomeStatus;
+
+struct Click {
+    double phase_step;  // radians per sample
+    float gain;
+    uint8_t voice;      // enum Voice, which outputs it is routed to
+};
 
 struct Measure {
     uint8_t beats;
     uint8_t unit;
+    uint8_t accents[MAX_BEATS_PER_MEASURE];     // enum Accent, ACCENT_AUTO accents beat 1 only
+    struct Click clicks[MAX_BEATS_PER_MEASURE]; // compiled from accents, read by the callback
 };
 
+// The UI's copy of the track, which it edits and reads. The callback plays
+// a TrackVersion instead and only ever writes active_measure here, which
+// the header keeps on a line of its own.
 struct Track {
-    struct Measure measures[MAX_MEASURES_PER_TRACK];
     uint8_t selection;
     uint8_t active_measure;
     uint8_t measure_count;
+
+    uint8_t looping;
+    uint8_t loop_from;
+    uint8_t loop_to;
+    uint16_t revision;  // bumped on every edit of measures
+
+    struct Measure measures[MAX_MEASURES_PER_TRACK] CACHE_ALIGNED;
+};
+
+// A measure as published to the callback. Never written once published,
+// and shared by every version of the track that did not change it.
+struct TrackMeasure {
+    uint32_t refs;
+    struct Measure measure;
+};
+
+// The track as the callback plays it. Each edit publishes a new version
+// that copies the table and makes a new TrackMeasure only for what it
+// changed, and the callback takes it up with one pointer swap. Versions
+// kept by the undo history are published again as they were.
+struct TrackVersion {
+    uint32_t refs;
+    uint8_t measure_count;
+    uint8_t looping;
+    uint8_t loop_from;
+    uint8_t loop_to;
+    uint8_t edited;     // measure the edit that made this version was on
+    uint8_t quantize;   // enum Quantize, the boundary the callback waits for
+    uint8_t lands_on;   // measure that boundary must be in, unless QUANTIZE_NOW
+    struct TrackMeasure *measures[MAX_MEASURES_PER_TRACK];
+};
+
+// Aligned to its size so a seek can hand one over in a single atomic store.
+struct Position {
+    uint8_t measure;
+    uint8_t beat;
+    uint32_t offset;    // samples into the beat
+} __attribute__((aligned(8)));
+
+// Sample positions of every measure for one pass of the track at a fixed
+// tempo; measure_start[i] is the prefix sum of all measures before i.
+// The track has no tempo of its own per measure, the only tempo changes
+// are practice ramps, generated programs and queued changes. Those move
+// beats off the map, exact says none of them is in play.
+struct TempoMap {
+    double measure_start[MAX_MEASURES_PER_TRACK+1];
+    double beat_samples[MAX_MEASURES_PER_TRACK];
+    uint8_t measure_count;
+    uint16_t revision;
+    bpm_t bpm;
+    uint8_t exact;
 };
 
 struct Practice {
-    uint8_t bpm_from;
-    uint8_t bpm_to;
-    uint8_t bpm_step;
+    bpm_t bpm_from;
+    bpm_t bpm_to;
+    bpm_t bpm_step;
     uint8_t interval;
-    uint8_t iteration;
+    uint8_t curve;      // enum PracticeCurve
+    uint8_t plateau;    // loops held at bpm_to once it is reached
+    bpm_t rebound;      // drop below bpm_to held for interval loops after the plateau
+
+    // a generated program instead of the ramp above, worked out a bar at a
+    // time from the seed, with interval bars to each of its blocks
+    uint8_t program;    // enum PracticeProgram
+    uint8_t dropout;    // percent of bars a dropout leaves silent at its fullest
+    uint32_t seed;
+    uint32_t bars;      // length of a program, 0 plays it forever
+
+    uint8_t stage;      // enum PracticeStage
+    uint32_t iteration; // loops of the track, or bars of a program
 };
 
-struct Metronome {
-    uint8_t bpm;
+// Gain from every click voice to each output the session plays on, from
+// m->channel up. fanout and routed are derived by metronome_set_route()
+// so the callback can pick a mixing path without looking at the row.
+struct Routing {
+    uint8_t channels;
+    float gains[VOICE_COUNT][MAX_ROUTE_CHANNELS];
+    float fanout[VOICE_COUNT];      // the gain all outputs of a voice share, 0 when they differ
+    uint8_t routed[VOICE_COUNT];    // the voice is heard on any output at all
+};
+
+// Playback position owned by the audio callback, one per instance so
+// nothing the callback touches per sample lives in a static.
+struct Engine {
+    double phase;
+    double beat_samples;    // exact, fractional length of the current beat
+    double beat_carry;      // rounding left over from earlier beats
+    uint32_t beat_sample_counter;
+    uint32_t beat_counter;
+    uint64_t frames;        // rendered since the last reset
+    uint64_t bar_frame;     // frame the current bar's downbeat played at
+    double sync_step;       // added to each of the next sync_beats beats
+    double sync_gap;        // sync_step if the current beat is being adjusted
+    uint8_t sync_beats;
+} CACHE_ALIGNED;
+
+// Phase correction posted by a sync peer. adjust samples are spread evenly
+// over the gaps of the next beats beats, starting at a bar line if bar is
+// set, and every beat is stretched by ratio to follow the leader's clock.
+// adjust, beats and bar are only written while pending is clear.
+struct Sync {
+    double ratio;
+    double adjust;
+    uint8_t beats;
+    uint8_t bar;
+    uint8_t pending;
+    uint64_t settled_frame; // written by the callback once an adjust has played out
+};
+
+// A tempo change the callback applies on the next beat or bar line. A
+// queued meter change is published as a version of the track instead.
+struct Change {
+    bpm_t bpm;
+    uint8_t quantize;   // enum Quantize
+    uint32_t sequence;  // the slot's turn: head+1 once filled, tail+CHANGE_QUEUE once taken
+};
+
+// Changes waiting for their beat or bar line, applied in the order they
+// were queued. Any thread may queue, only the callback takes, and a slot
+// is never written while the callback can still be reading it.
+struct ChangeQueue {
+    struct Change slots[CHANGE_QUEUE];
+    uint32_t head;      // next slot to fill
+    uint32_t tail;      // next slot to take
+};
+
+struct BeatEvent {
+    uint64_t frame;
+    bpm_t bpm;
+    uint8_t measure;
+    uint8_t beat;
+    uint8_t count_in;   // beat of the count-in, measure is the one it leads into
+    uint8_t silent;     // in a bar the practice program dropped, no click is heard
+};
 
+// Fields are grouped by which thread writes them, each group starting on
+// its own cache line, so UI edits do not invalidate the lines the callback
+// writes on every period. Fields both sides write are noted per group.
+struct Metronome {
+    // written by the UI, read by the audio callback
+    bpm_t base_bpm CACHE_ALIGNED;
     uint8_t practice_count;
+    uint8_t practice_autostop;
+    uint8_t channel;    // first of the output channels this session plays on
+    uint8_t hosted;     // rendered by a host or offline, never opens a device of its own
+    uint8_t realtime;   // opted in with metronome_realtime()
+    struct MetronomeStatus *status; // shared memory status block, NULL unless opened
+    struct Routing routing;     // the UI's, edited in place and saved
+    struct Routing routes[2];   // copies of it, one mixed with, one built for the next change
+    uint8_t route_live;         // which of routes the callback mixes with
+
+    // posted by the UI and taken by the callback, which clears the flag or
+    // moves the queue tail.
+    // Only dirtied when something is posted.
+    struct Position seek_to CACHE_ALIGNED;
+    uint8_t reset;
+    uint8_t seek;
+    struct ChangeQueue changes;
+    struct Sync sync;
+    struct TrackVersion *published; // newest version of the track
+    uint8_t published_waits;        // it waits for a beat or bar line
+
+    // written by the audio callback, read by the UI. The UI sets bpm and
+    // state too, but the callback writes them every beat of a ramp and
+    // when a program ends, so both sides go through __atomic builtins.
+    bpm_t bpm CACHE_ALIGNED;
+    enum MetronomeState state;
+    uint8_t tick;
     uint8_t practice_current;
     uint8_t practice_active;
+    uint8_t practice_silent;    // the bar being played was dropped by the program
+    uint8_t realtime_granted;   // enum RealtimeGuarantee
+    uint8_t realtime_tried;     // the callback asked for SCHED_FIFO once
+    uint32_t rendering;         // odd while a callback is rendering this session
+    const struct TrackVersion *playing; // the version taken up from published
 
-    enum MetronomeState state;
+    // engine frame the last callback started rendering at, and when,
+    // behind a seqlock so readers never see a torn pair
+    uint32_t clock_sequence;
+    int64_t clock_ns;           // CLOCK_MONOTONIC
+    uint64_t clock_frame;
 
-    struct Measure count_in;
+    // every beat played, readers keep their own tail and spot overruns
+    // by how far beat_head has moved past it. beat_writing runs one ahead
+    // while a slot is being written, for readers to spot one lapped under
+    // them.
+    uint32_t beat_head;
+    uint32_t beat_writing;
+    struct BeatEvent beat_events[BEAT_EVENTS];
+
+    struct Engine engine;
+
+    // session data, edited by the UI and played by the callback, the track
+    // as versions published from it. The callback also counts iteration and
+    // stage of the running practice set.
+    struct Measure count_in CACHE_ALIGNED;
     struct Practice practice[MAX_PRACTICE_SETS];
-    struct Track track; 
+    struct Track track;
 
-    uint8_t base_bpm;
+    struct TempoMap map CACHE_ALIGNED;
 
-    uint8_t tick;
-    uint8_t reset;
+    // versions published and given up, guarded by track_lock. Freed once
+    // the callback no longer plays them.
+    pthread_mutex_t track_lock CACHE_ALIGNED;
+    struct TrackVersion *retired[TRACK_RETIRED];
+    uint8_t retired_count;
+    uint8_t track_stale;    // an edit could not be published, the next rebuilds the version
+
+    // device lifecycle, guarded by device_lock. The device is opened by
+    // device_thread and kept running for idle_ms after a stop so a restart
+    // is immediate, then released until the next start.
+    pthread_mutex_t device_lock CACHE_ALIGNED;
+    pthread_cond_t device_wake;
+    pthread_t device_thread;
+    uint8_t device_threaded;
+    uint8_t device_state;   // enum DeviceState
+    uint8_t device_closing;
+    ma_result device_result;    // why the device failed to open, MA_SUCCESS otherwise
+    uint32_t idle_ms;       // 0 keeps a stopped device running
+    int64_t latency_ns;     // from a rendered frame to it being heard, set once open
+    int64_t stopped_ns;     // CLOCK_MONOTONIC, 0 while playing
+
+    ma_device device CACHE_ALIGNED;
+};
+
+// The sections of the save file, so a change can be written on its own.
+enum SessionPart {
+    SESSION_TEMPO    = 1 << 0,  // bpm, base_bpm and the count-in
+    SESSION_TRACK    = 1 << 1,
+    SESSION_PRACTICE = 1 << 2,
+    SESSION_ROUTING  = 1 << 3,
+    SESSION_ALL      = SESSION_TEMPO | SESSION_TRACK | SESSION_PRACTICE | SESSION_ROUTING,
+};
+
+// The part of a session that is saved, copied out by metronome_snapshot()
+// so it can be written away from the UI thread.
+struct Session {
+    bpm_t bpm;
+    bpm_t base_bpm;
+    struct Measure count_in;
+    struct Practice practice[MAX_PRACTICE_SETS];
+    uint8_t practice_count;
+    uint8_t practice_autostop;
+    struct Track track;
+    struct Routing routing;
+};
+
+// Several independent sessions mixed into one device, each on its own
+// channel pair of a multichannel output.
+struct MetronomeHost {
+    struct Metronome *sessions[MAX_SESSIONS];   // NULL where one was removed
+    uint8_t session_count;
+    uint8_t channels;
+    uint32_t rendering;     // odd while the callback is rendering sessions
     ma_device device;
 };
 
+extern void metronome_init(struct Metronome *m);
 extern int metronome_setup(struct Metronome *m);
 extern void metronome_shutdown(struct Metronome *m);
+extern int metronome_wait_device(struct Metronome *m);
+extern uint8_t metronome_realtime(struct Metronome *m);
+extern void metronome_realtime_describe(uint8_t granted, char *out, size_t size);
+extern void metronome_render(struct Metronome *m, float *out, const uint32_t frame_count, const uint32_t channels);
+
+extern int metronome_host_setup(struct MetronomeHost *h, const uint8_t channels);
+extern struct Metronome *metronome_host_add(struct MetronomeHost *h, const uint8_t channel);
+extern void metronome_host_remove(struct MetronomeHost *h, struct Metronome *m);
+extern void metronome_host_shutdown(struct MetronomeHost *h);
 
 extern void metronome_save(const struct Metronome *m, const char *path);
+extern int metronome_load(struct Metronome *m, const char *path);
+extern void metronome_session_path(const char *path, char *out, size_t size);
+extern void metronome_snapshot(const struct Metronome *m, struct Session *s);
+extern uint8_t metronome_session_diff(const struct Session *a, const struct Session *b);
+extern char *metronome_session_json(const struct Session *s, uint8_t parts, uint8_t pretty);
+extern int metronome_parse(struct Metronome *m, const char *text);
+extern int metronome_parse_parts(struct Metronome *m, const char *text);
 
 extern void metronome_set_beats(struct Metronome *m, const int value);
 extern void metronome_set_unit(struct Metronome *m, const int value);
@@ -59,13 +357,40 @@ extern void metronome_inc_unit(struct Metronome *m);
 extern void metronome_dec_beats(struct Metronome *m);
 extern void metronome_inc_beats(struct Metronome *m);
 
-extern void metronome_insert_measure_at_start(struct Metronome *m);
-extern void metronome_insert_measure_before(struct Metronome *m);
-extern void metronome_insert_measure_after(struct Metronome *m);
-extern void metronome_insert_measure_at_end(struct Metronome *m);
+extern void metronome_set_accent(struct Metronome *m, const uint8_t beat, const uint8_t level);
+extern void metronome_set_route(struct Metronome *m, uint8_t voice, const float *gains, uint8_t channels);
+extern int metronome_set_grouping(struct Metronome *m, const char *grouping);
+
+extern int metronome_insert_measure_at_start(struct Metronome *m);
+extern int metronome_insert_measure_before(struct Metronome *m);
+extern int metronome_insert_measure_after(struct Metronome *m);
+extern int metronome_insert_measure_at_end(struct Metronome *m);
 
 extern void metronome_remove_measure(struct Metronome *m);
 
-extern void metronome_practice_set_from_bpm(struct Practice *, uint8_t bpm);
+extern void metronome_set_bpm(struct Metronome *m, const double value);
+extern void metronome_inc_bpm(struct Metronome *m);
+extern void metronome_dec_bpm(struct Metronome *m);
+
+extern const struct TempoMap *metronome_tempo_map(struct Metronome *m);
+extern struct Position metronome_locate(const struct TempoMap *map, uint64_t sample);
+extern uint64_t metronome_position_to_sample(const struct TempoMap *map, const struct Position *pos);
+extern void metronome_seek(struct Metronome *m, uint8_t measure, uint8_t beat);
+extern int metronome_seek_sample(struct Metronome *m, uint64_t sample);
+extern void metronome_set_loop(struct Metronome *m, uint8_t from, uint8_t to);
+extern void metronome_clear_loop(struct Metronome *m);
+
+extern int metronome_queue_change(struct Metronome *m, bpm_t bpm, uint8_t beats, uint8_t unit, uint8_t quantize);
+extern uint8_t metronome_change_queued(const struct Metronome *m);
+extern uint32_t metronome_read_beats(const struct Metronome *m, uint32_t tail, struct BeatEvent *events, uint32_t max_events);
+
+extern void metronome_practice_set_from_bpm(struct Practice *, bpm_t bpm);
+extern uint32_t metronome_practice_length(const struct Practice *p);
+extern void metronome_practice_start(struct Metronome *m, uint8_t set);
 extern void metronome_start(struct Metronome *m);
 extern void metronome_stop(struct Metronome *m);
+extern void metronome_wait_render(struct Metronome *m);
+extern struct TrackVersion *metronome_track_retain(struct Metronome *m);
+extern struct TrackVersion *metronome_track_restore(struct Metronome *m, struct TrackVersion *v);
+extern void metronome_track_release(struct TrackVersion *v);
+extern void metronome_track_free(struct Metronome *m);